@@ -0,0 +1,208 @@
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef DPS_COLUMNAR_H_
+#define DPS_COLUMNAR_H_
+
+// Columnar result files. A header, the column descriptors and a block of
+// newline separated labels are followed by each column as one contiguous
+// array, 8-byte aligned, so a reader can map any column straight from the
+// file. The file is sized when it's created, with NaN in every float cell
+// and 0 in every integer one. Rows are then written in place as they
+// complete, in any order and from any thread, so a reader sees partial
+// results while a run goes on.
+struct ColumnarHeader {
+    char magic[4] = { 'D', 'P', 'S', 'C' };
+    uint32_t version = 1;
+    // 0x01020304 in the writer's byte order
+    uint32_t byteOrder = 0x01020304;
+    uint32_t numColumns = 0;
+    uint64_t numRows = 0;
+    // Of the first column
+    uint64_t dataOffset = 0;
+    uint64_t labelsSize = 0;
+};
+
+struct ColumnarColumn {
+    char name[24] = { 0 };
+    // numpy type code: "f8" or "u4"
+    char type[8] = { 0 };
+
+    bool isFloat() const {
+        return ::strcmp(type, "f8") == 0;
+    }
+    size_t getSize() const {
+        return isFloat() ? 8 : 4;
+    }
+};
+
+inline uint64_t alignColumnar(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+class ColumnarWriter {
+    int fd = -1;
+    std::vector<ColumnarColumn> columns;
+    std::vector<uint64_t> offsets;
+
+    bool writeAt(uint64_t offset, const void *data, size_t size) {
+        const char *ptr = static_cast<const char *>(data);
+        while (size) {
+            ssize_t n = ::pwrite(fd, ptr, size, off_t(offset));
+            if (n <= 0)
+                return false;
+            ptr += n;
+            offset += uint64_t(n);
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+public:
+    ColumnarWriter() { }
+    ~ColumnarWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    ColumnarWriter(const ColumnarWriter &) = delete;
+    ColumnarWriter &operator=(const ColumnarWriter &) = delete;
+
+    // Columns as (name, type) pairs. False if the file can't be written.
+    bool create(const std::string &path,
+                const std::vector<std::pair<std::string, std::string>> &cols,
+                uint64_t numRows, const std::string &labels) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        ColumnarHeader header;
+        header.numColumns = uint32_t(cols.size());
+        header.numRows = numRows;
+        header.labelsSize = labels.size();
+        for (const auto &col : cols) {
+            ColumnarColumn column;
+            ::strncpy(column.name, col.first.c_str(), sizeof(column.name) - 1);
+            ::strncpy(column.type, col.second.c_str(), sizeof(column.type) - 1);
+            columns.push_back(column);
+        }
+        uint64_t offset = alignColumnar(sizeof(header) + cols.size() * sizeof(ColumnarColumn) +
+                                        labels.size());
+        header.dataOffset = offset;
+        for (const ColumnarColumn &column : columns) {
+            offsets.push_back(offset);
+            offset = alignColumnar(offset + numRows * column.getSize());
+        }
+        if (::ftruncate(fd, off_t(offset)) != 0 ||
+            !writeAt(0, &header, sizeof(header)) ||
+            !writeAt(sizeof(header), columns.data(), columns.size() * sizeof(ColumnarColumn)) ||
+            !writeAt(sizeof(header) + columns.size() * sizeof(ColumnarColumn),
+                     labels.data(), labels.size()))
+            return false;
+        const std::vector<double> nans(numRows, NAN);
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i].isFloat() && !writeAt(offsets[i], nans.data(), numRows * 8))
+                return false;
+        }
+        return true;
+    }
+
+    bool set(uint64_t row, size_t column, double val) {
+        return columns[column].isFloat() && writeAt(offsets[column] + row * 8, &val, 8);
+    }
+    bool set(uint64_t row, size_t column, uint32_t val) {
+        return !columns[column].isFloat() && writeAt(offsets[column] + row * 4, &val, 4);
+    }
+};
+
+// A whole columnar file read into memory
+class ColumnarReader {
+    std::vector<char> data;
+    ColumnarHeader header;
+    std::vector<ColumnarColumn> columns;
+    std::vector<uint64_t> offsets;
+
+public:
+    // False if the file can't be read or isn't a columnar file
+    bool load(const std::string &path) {
+        FILE *file = ::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        char buf[65536];
+        size_t n;
+        while ((n = ::fread(buf, 1, sizeof(buf), file)) > 0) {
+            data.insert(data.end(), buf, buf + n);
+        }
+        ::fclose(file);
+        if (data.size() < sizeof(header))
+            return false;
+        ::memcpy(&header, data.data(), sizeof(header));
+        if (::memcmp(header.magic, "DPSC", 4) != 0 || header.version != 1 ||
+            header.byteOrder != 0x01020304)
+            return false;
+        uint64_t offset = header.dataOffset;
+        for (uint32_t i = 0; i < header.numColumns; ++i) {
+            size_t at = sizeof(header) + i * sizeof(ColumnarColumn);
+            if (at + sizeof(ColumnarColumn) > data.size())
+                return false;
+            ColumnarColumn column;
+            ::memcpy(&column, data.data() + at, sizeof(column));
+            column.name[sizeof(column.name) - 1] = '\0';
+            column.type[sizeof(column.type) - 1] = '\0';
+            columns.push_back(column);
+            offsets.push_back(offset);
+            offset = alignColumnar(offset + header.numRows * column.getSize());
+        }
+        size_t labelsAt = sizeof(header) + header.numColumns * sizeof(ColumnarColumn);
+        return offset <= data.size() && labelsAt + header.labelsSize <= data.size();
+    }
+
+    static bool isColumnar(const std::string &path) {
+        FILE *file = ::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        char magic[4];
+        bool result = ::fread(magic, 1, 4, file) == 4 && ::memcmp(magic, "DPSC", 4) == 0;
+        ::fclose(file);
+        return result;
+    }
+
+    uint64_t getNumRows() const {
+        return header.numRows;
+    }
+    std::string getLabels() const {
+        size_t at = sizeof(header) + header.numColumns * sizeof(ColumnarColumn);
+        return std::string(data.data() + at, header.labelsSize);
+    }
+    // The column's index, or -1
+    int find(const char *name) const {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (::strcmp(columns[i].name, name) == 0)
+                return int(i);
+        }
+        return -1;
+    }
+    bool isFloat(size_t column) const {
+        return columns[column].isFloat();
+    }
+    double getFloat(size_t column, uint64_t row) const {
+        double val;
+        ::memcpy(&val, data.data() + offsets[column] + row * 8, 8);
+        return val;
+    }
+    uint32_t getUnsigned(size_t column, uint64_t row) const {
+        uint32_t val;
+        ::memcpy(&val, data.data() + offsets[column] + row * 4, 4);
+        return val;
+    }
+};
+
+#endif
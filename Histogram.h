@@ -0,0 +1,113 @@
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifndef DPS_HISTOGRAM_H_
+#define DPS_HISTOGRAM_H_
+
+// Streaming histogram with HDR-style log-linear buckets. Every power of two
+// [2^e, 2^(e+1)) for MinExp <= e < MaxExp is split into 2^SubBucketBits
+// equal buckets, so the bucket width is at most 2^-SubBucketBits of the
+// value over the whole range. Values below 2^MinExp share the first bucket
+// and values from 2^MaxExp up the last one. The memory is fixed, and adding
+// a value is a single bucket increment.
+template <int MinExp, int MaxExp, unsigned SubBucketBits>
+class LogLinearHistogram {
+    static_assert(MinExp > -1022 && MaxExp < 1024 && MinExp < MaxExp,
+                  "Exponents must be in the normal double range");
+
+public:
+    static const size_t NumBuckets = (size_t(MaxExp - MinExp) << SubBucketBits) + 2;
+
+private:
+    uint64_t counts[NumBuckets] = { 0 };
+
+public:
+    // Read straight from the exponent and the top of the mantissa bits
+    static size_t getBucket(double val) {
+        uint64_t bits;
+        ::memcpy(&bits, &val, sizeof(bits));
+        // Negative values
+        if (bits >> 63)
+            return 0;
+        int exp = int(bits >> 52) - 1023;
+        // Including zero and subnormals
+        if (exp < MinExp)
+            return 0;
+        // Including infinity and NaN
+        if (exp >= MaxExp)
+            return NumBuckets - 1;
+        size_t sub = size_t(bits >> (52 - SubBucketBits)) & ((size_t(1) << SubBucketBits) - 1);
+        return 1 + (size_t(exp - MinExp) << SubBucketBits) + sub;
+    }
+    static double getBucketLow(size_t bucket) {
+        if (bucket == 0)
+            return 0.0;
+        if (bucket == NumBuckets - 1)
+            return std::ldexp(1.0, MaxExp);
+        size_t idx = bucket - 1;
+        int exp = MinExp + int(idx >> SubBucketBits);
+        size_t sub = idx & ((size_t(1) << SubBucketBits) - 1);
+        return std::ldexp(1.0 + std::ldexp(double(sub), -int(SubBucketBits)), exp);
+    }
+    static double getBucketHigh(size_t bucket) {
+        if (bucket == NumBuckets - 1)
+            return INFINITY;
+        return getBucketLow(bucket + 1);
+    }
+
+    void add(double val) {
+        ++counts[getBucket(val)];
+    }
+    void merge(const LogLinearHistogram &other) {
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            counts[i] += other.counts[i];
+        }
+    }
+    uint64_t getCount(size_t bucket) const {
+        return counts[bucket];
+    }
+
+    // One 'name,low,high,count' line per non-empty bucket
+    void printCsv(FILE *file, const char *name) const {
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            if (!counts[i])
+                continue;
+            fprintf(file, "%s,%.17g,%.17g,%llu\n", name, getBucketLow(i),
+                    getBucketHigh(i), (unsigned long long)counts[i]);
+        }
+    }
+};
+
+// Histogram of a weight (e.g. time) per integer value 0 .. NumBuckets - 1.
+// Larger values share the last bucket.
+template <size_t NumBuckets>
+class LinearHistogram {
+    double weights[NumBuckets] = { 0.0 };
+
+public:
+    void add(size_t val, double weight) {
+        weights[val < NumBuckets ? val : NumBuckets - 1] += weight;
+    }
+    void merge(const LinearHistogram &other) {
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            weights[i] += other.weights[i];
+        }
+    }
+    double getWeight(size_t bucket) const {
+        return weights[bucket];
+    }
+
+    // One 'name,low,high,weight' line per non-empty bucket
+    void printCsv(FILE *file, const char *name) const {
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            if (weights[i] == 0.0)
+                continue;
+            fprintf(file, "%s,%zu,%zu,%.17g\n", name, i, i + 1, weights[i]);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef DPS_PERF_H_
+#define DPS_PERF_H_
+
+#define PERF_COUNTER_LIST                                                      \
+    X(Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS)            \
+    X(Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES)                    \
+    X(L1DMisses, PERF_TYPE_HW_CACHE,                                           \
+      PERF_COUNT_HW_CACHE_L1D |                                                \
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |                                     \
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))                                 \
+    X(CacheMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)
+
+// Hardware counters for the calling thread and the threads it creates
+// afterwards, read with perf_event_open.
+// Counters the kernel won't give us (no PMU, perf_event_paranoid, not Linux)
+// are reported as unavailable rather than failing the run.
+class PerfCounters {
+public:
+    enum Counter {
+        #define X(NAME, TYPE, CONFIG) PC_##NAME,
+        PERF_COUNTER_LIST
+        #undef X
+        NumCounters
+    };
+
+private:
+    int fds[NumCounters];
+    uint64_t values[NumCounters];
+
+#ifdef __linux__
+    static int open(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Also count threads created after the counters are opened
+        attr.inherit = 1;
+        return int(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+public:
+    PerfCounters() {
+        #define X(NAME, TYPE, CONFIG) fds[PC_##NAME] = -1;
+        PERF_COUNTER_LIST
+        #undef X
+#ifdef __linux__
+        #define X(NAME, TYPE, CONFIG) fds[PC_##NAME] = open(TYPE, CONFIG);
+        PERF_COUNTER_LIST
+        #undef X
+#endif
+        for (uint64_t &val : values) {
+            val = 0;
+        }
+    }
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+#endif
+    }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    static const char *getName(Counter c) {
+        switch (c) {
+        #define X(NAME, TYPE, CONFIG) case PC_##NAME: return #NAME;
+        PERF_COUNTER_LIST
+        #undef X
+        case NumCounters:
+            break;
+        }
+        return "";
+    }
+
+    bool isAvailable(Counter c) const { return fds[c] >= 0; }
+    uint64_t get(Counter c) const { return values[c]; }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (size_t i = 0; i < NumCounters; ++i) {
+            if (fds[i] < 0)
+                continue;
+            ::ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t val = 0;
+            if (::read(fds[i], &val, sizeof(val)) != sizeof(val)) {
+                ::close(fds[i]);
+                fds[i] = -1;
+                continue;
+            }
+            values[i] = val;
+        }
+#endif
+    }
+
+    // Print each counter, and its rate per 'unit' if 'units' is non-zero
+    void print(FILE *file, uint64_t units, const char *unit) const {
+        for (size_t i = 0; i < NumCounters; ++i) {
+            Counter c = Counter(i);
+            if (!isAvailable(c)) {
+                fprintf(file, "    %s: unavailable\n", getName(c));
+            } else if (units) {
+                fprintf(file, "    %s: %llu (%.3f per %s)\n", getName(c),
+                        (unsigned long long)values[i],
+                        double(values[i]) / units, unit);
+            } else {
+                fprintf(file, "    %s: %llu\n", getName(c),
+                        (unsigned long long)values[i]);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include <cstdint>
+
+#ifndef DPS_RANDOM_H_
+#define DPS_RANDOM_H_
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"). Block n of a stream is a pure function of
+// the key and the counter, so any stream can be positioned anywhere without
+// generating what comes before it.
+struct Philox4x32 {
+    using Counter = uint32_t[4];
+    using Key = uint32_t[2];
+
+    static void generate(const Counter ctr, const Key key, uint32_t out[4]) {
+        uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        uint32_t k0 = key[0], k1 = key[1];
+        for (unsigned round = 0; round < 10; ++round) {
+            uint64_t p0 = uint64_t(0xD2511F53) * c0;
+            uint64_t p1 = uint64_t(0xCD9E8D57) * c2;
+            uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+            uint32_t n1 = uint32_t(p1);
+            uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+            uint32_t n3 = uint32_t(p0);
+            c0 = n0; c1 = n1; c2 = n2; c3 = n3;
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+};
+
+// One random stream, addressed by a 64-bit key and a 64-bit stream id.
+// Distinct (key, id) pairs give independent streams, and the values drawn
+// from a stream never depend on what other streams have drawn. A mirrored
+// stream returns max() - x for every x of the plain one.
+class RandomStream {
+    uint32_t key[2] = { 0, 0 };
+    uint32_t id[2] = { 0, 0 };
+    uint64_t block = 0;
+    uint32_t buf[4];
+    uint32_t mask = 0;
+    unsigned pos = 4;
+
+public:
+    using result_type = uint32_t;
+
+    RandomStream() { }
+    RandomStream(uint64_t key64, uint64_t id64, bool mirrored = false) {
+        init(key64, id64, mirrored);
+    }
+
+    void init(uint64_t key64, uint64_t id64, bool mirrored = false) {
+        key[0] = uint32_t(key64);
+        key[1] = uint32_t(key64 >> 32);
+        id[0] = uint32_t(id64);
+        id[1] = uint32_t(id64 >> 32);
+        mask = mirrored ? UINT32_MAX : 0;
+        block = 0;
+        pos = 4;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    result_type operator()() {
+        if (pos == 4) {
+            uint32_t ctr[4] = { uint32_t(block), uint32_t(block >> 32), id[0], id[1] };
+            Philox4x32::generate(ctr, key, buf);
+            ++block;
+            pos = 0;
+        }
+        return buf[pos++] ^ mask;
+    }
+
+    // Values drawn so far
+    uint64_t getNumDraws() const {
+        return block * 4 - (4 - pos);
+    }
+};
+
+#endif
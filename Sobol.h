@@ -0,0 +1,121 @@
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Random.h"
+
+#ifndef DPS_SOBOL_H_
+#define DPS_SOBOL_H_
+
+// Sobol low-discrepancy sequence in [0, 1)^dims (Bratley and Fox, "Algorithm
+// 659"). The first dimension is the van der Corput sequence, and the others
+// use the primitive polynomials over GF(2) in increasing order, found at
+// construction, so there's no limit on the number of dimensions. The
+// initial direction numbers are fixed pseudo-random odd numbers instead of
+// a tuned table such as Joe and Kuo's: every dimension is still a (0, 1)
+// sequence, but some two-dimensional projections are less even.
+class SobolSequence {
+    static const unsigned Bits = 32;
+
+    // Direction numbers, Bits per dimension
+    std::vector<uint32_t> directions;
+    std::vector<uint32_t> cur;
+    uint32_t index = 0;
+
+    // Multiply polynomials over GF(2) modulo 'poly' of degree 'degree'
+    static uint32_t mulMod(uint32_t a, uint32_t b, uint32_t poly, unsigned degree) {
+        uint32_t out = 0;
+        for (; b; b >>= 1) {
+            if (b & 1)
+                out ^= a;
+            a <<= 1;
+            if (a >> degree & 1)
+                a ^= poly;
+        }
+        return out;
+    }
+    static uint32_t powMod(uint32_t a, uint32_t e, uint32_t poly, unsigned degree) {
+        uint32_t out = 1;
+        for (; e; e >>= 1) {
+            if (e & 1)
+                out = mulMod(out, a, poly, degree);
+            a = mulMod(a, a, poly, degree);
+        }
+        return out;
+    }
+    // x has the full order 2^degree - 1 modulo 'poly'
+    static bool isPrimitive(uint32_t poly, unsigned degree) {
+        if (!(poly & 1))
+            return false;
+        const uint32_t order = (uint32_t(1) << degree) - 1;
+        if (powMod(2, order, poly, degree) != 1)
+            return false;
+        uint32_t rest = order;
+        for (uint32_t q = 2; q <= rest; ++q) {
+            if (rest % q)
+                continue;
+            if (powMod(2, order / q, poly, degree) == 1)
+                return false;
+            while (rest % q == 0) {
+                rest /= q;
+            }
+        }
+        return true;
+    }
+
+public:
+    explicit SobolSequence(size_t dims) : directions(dims * Bits), cur(dims, 0) {
+        RandomStream rng(0x50B0150B, 0);
+        for (unsigned k = 0; k < Bits; ++k) {
+            directions[k] = uint32_t(1) << (Bits - 1 - k);
+        }
+        uint32_t poly = 2;
+        unsigned degree = 1;
+        for (size_t d = 1; d < dims; ++d) {
+            do {
+                ++poly;
+                if (poly >> (degree + 1))
+                    ++degree;
+            } while (!isPrimitive(poly, degree));
+            assert(degree < Bits);
+
+            // m[k] is odd and below 2^(k + 1)
+            uint32_t m[Bits];
+            for (unsigned k = 0; k < degree; ++k) {
+                m[k] = k ? ((rng() & ((uint32_t(1) << k) - 1)) << 1) | 1 : 1;
+            }
+            for (unsigned k = degree; k < Bits; ++k) {
+                m[k] = m[k - degree] ^ (m[k - degree] << degree);
+                for (unsigned j = 1; j < degree; ++j) {
+                    if (poly >> (degree - j) & 1)
+                        m[k] ^= m[k - j] << j;
+                }
+            }
+            for (unsigned k = 0; k < Bits; ++k) {
+                directions[d * Bits + k] = m[k] << (Bits - 1 - k);
+            }
+        }
+    }
+
+    size_t getDims() const {
+        return cur.size();
+    }
+
+    // Points in Gray code order, skipping the first one (the origin)
+    void next(std::vector<double> &point) {
+        unsigned c = 0;
+        for (uint32_t i = index; i & 1; i >>= 1) {
+            ++c;
+        }
+        assert(c < Bits);
+        ++index;
+        point.resize(cur.size());
+        for (size_t d = 0; d < cur.size(); ++d) {
+            cur[d] ^= directions[d * Bits + c];
+            point[d] = cur[d] * (1.0 / 4294967296.0);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#ifndef DPS_STATS_H_
+#define DPS_STATS_H_
+
+inline double getMean(const std::vector<double> &vals) {
+    assert(!vals.empty());
+    double sum = 0.0;
+    for (double v : vals) {
+        sum += v;
+    }
+    return sum / vals.size();
+}
+
+// Unbiased sample variance
+inline double getVariance(const std::vector<double> &vals) {
+    if (vals.size() < 2)
+        return NAN;
+    double mean = getMean(vals);
+    double sum = 0.0;
+    for (double v : vals) {
+        sum += (v - mean) * (v - mean);
+    }
+    return sum / (vals.size() - 1);
+}
+
+// Solve the symmetric system a * x = b using Gaussian elimination.
+// Columns with a negligible pivot are treated as redundant and get a zero
+// coefficient, so linearly dependent inputs don't blow up the solution.
+inline std::vector<double> solveLinear(std::vector<std::vector<double>> a,
+                                       std::vector<double> b) {
+    const size_t n = b.size();
+    std::vector<bool> used(n, false);
+    std::vector<size_t> pivotRow(n, n);
+    std::vector<double> scale(n);
+    for (size_t i = 0; i < n; ++i) {
+        scale[i] = std::fabs(a[i][i]);
+    }
+    for (size_t col = 0; col < n; ++col) {
+        size_t best = n;
+        for (size_t row = 0; row < n; ++row) {
+            if (used[row])
+                continue;
+            if (best == n || std::fabs(a[row][col]) > std::fabs(a[best][col]))
+                best = row;
+        }
+        if (best == n || std::fabs(a[best][col]) <= 1e-12 * scale[col])
+            continue;
+        used[best] = true;
+        pivotRow[col] = best;
+        for (size_t row = 0; row < n; ++row) {
+            if (row == best)
+                continue;
+            double f = a[row][col] / a[best][col];
+            if (f == 0.0)
+                continue;
+            for (size_t k = col; k < n; ++k) {
+                a[row][k] -= f * a[best][k];
+            }
+            b[row] -= f * b[best];
+        }
+    }
+    std::vector<double> x(n, 0.0);
+    for (size_t col = 0; col < n; ++col) {
+        if (pivotRow[col] != n) {
+            x[col] = b[pivotRow[col]] / a[pivotRow[col]][col];
+        }
+    }
+    return x;
+}
+
+// Cholesky factorization of a symmetric positive definite matrix in place:
+// the lower triangle of 'a' becomes L with a = L * L^T. False if 'a' isn't
+// positive definite.
+inline bool choleskyDecompose(std::vector<std::vector<double>> &a) {
+    const size_t n = a.size();
+    for (size_t j = 0; j < n; ++j) {
+        double d = a[j][j];
+        for (size_t k = 0; k < j; ++k) {
+            d -= a[j][k] * a[j][k];
+        }
+        if (!(d > 0.0))
+            return false;
+        a[j][j] = std::sqrt(d);
+        for (size_t i = j + 1; i < n; ++i) {
+            double v = a[i][j];
+            for (size_t k = 0; k < j; ++k) {
+                v -= a[i][k] * a[j][k];
+            }
+            a[i][j] = v / a[j][j];
+        }
+    }
+    return true;
+}
+
+// Solve L * x = b for the factor of choleskyDecompose
+inline std::vector<double> solveLower(const std::vector<std::vector<double>> &l,
+                                      std::vector<double> b) {
+    for (size_t i = 0; i < b.size(); ++i) {
+        for (size_t k = 0; k < i; ++k) {
+            b[i] -= l[i][k] * b[k];
+        }
+        b[i] /= l[i][i];
+    }
+    return b;
+}
+
+// Solve L^T * x = b for the factor of choleskyDecompose
+inline std::vector<double> solveUpper(const std::vector<std::vector<double>> &l,
+                                      std::vector<double> b) {
+    for (size_t i = b.size(); i-- > 0;) {
+        for (size_t k = i + 1; k < b.size(); ++k) {
+            b[i] -= l[k][i] * b[k];
+        }
+        b[i] /= l[i][i];
+    }
+    return b;
+}
+
+// Distance from x to the convex hull of 'points', by Wolfe's minimum norm
+// point algorithm on the points relative to x. It's exact up to rounding,
+// so x is only inside a hull of lower dimension (e.g. points that differ
+// in one coordinate) when it lies in the same subspace.
+inline double getHullDistance(const std::vector<std::vector<double>> &points,
+                              const std::vector<double> &x) {
+    const size_t n = points.size();
+    if (n == 0)
+        return INFINITY;
+    auto dot = [](const std::vector<double> &a, const std::vector<double> &b) {
+        double sum = 0.0;
+        for (size_t k = 0; k < a.size(); ++k) {
+            sum += a[k] * b[k];
+        }
+        return sum;
+    };
+    std::vector<std::vector<double>> p(n, x);
+    double maxNorm2 = 0.0;
+    size_t nearest = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < x.size(); ++k) {
+            p[i][k] = points[i][k] - x[k];
+        }
+        double norm2 = dot(p[i], p[i]);
+        maxNorm2 = std::max(maxNorm2, norm2);
+        if (norm2 < dot(p[nearest], p[nearest])) {
+            nearest = i;
+        }
+    }
+    const double eps = 1e-12 * maxNorm2;
+
+    // The current point is a convex combination of the active points
+    std::vector<size_t> active(1, nearest);
+    std::vector<double> lambda(1, 1.0);
+    std::vector<double> y = p[nearest];
+    // Rounding can make it cycle, which an exact run never does
+    for (size_t iter = 0; iter < 10 * n + 10; ++iter) {
+        double norm2 = dot(y, y);
+        if (norm2 <= eps)
+            return 0.0;
+        // Done when no point is closer to the origin along y
+        size_t next = 0;
+        for (size_t i = 1; i < n; ++i) {
+            if (dot(y, p[i]) < dot(y, p[next])) {
+                next = i;
+            }
+        }
+        if (norm2 - dot(y, p[next]) <= eps ||
+            std::find(active.begin(), active.end(), next) != active.end())
+            break;
+        active.push_back(next);
+        lambda.push_back(0.0);
+
+        for (;;) {
+            // Minimum norm point of the affine hull of the active points.
+            // Adding a constant to the Gram matrix doesn't move it, and
+            // makes the matrix definite for affinely independent points.
+            const size_t m = active.size();
+            std::vector<std::vector<double>> gram(m, std::vector<double>(m));
+            for (size_t i = 0; i < m; ++i) {
+                for (size_t j = 0; j <= i; ++j) {
+                    gram[i][j] = gram[j][i] =
+                        dot(p[active[i]], p[active[j]]) + maxNorm2;
+                }
+            }
+            if (!choleskyDecompose(gram))
+                return std::sqrt(norm2);
+            std::vector<double> alpha =
+                solveUpper(gram, solveLower(gram, std::vector<double>(m, 1.0)));
+            double sum = 0.0;
+            for (double a : alpha) {
+                sum += a;
+            }
+            bool inside = true;
+            for (double &a : alpha) {
+                a /= sum;
+                inside = inside && a > 0.0;
+            }
+            if (inside) {
+                lambda = alpha;
+                break;
+            }
+            // Move towards it until a weight drops to zero, and drop that
+            // point
+            double theta = 1.0;
+            size_t drop = 0;
+            for (size_t i = 0; i < m; ++i) {
+                if (alpha[i] <= 0.0 && lambda[i] / (lambda[i] - alpha[i]) <= theta) {
+                    theta = lambda[i] / (lambda[i] - alpha[i]);
+                    drop = i;
+                }
+            }
+            for (size_t i = 0; i < m; ++i) {
+                lambda[i] += theta * (alpha[i] - lambda[i]);
+            }
+            lambda[drop] = 0.0;
+            for (size_t i = m; i-- > 0;) {
+                if (lambda[i] <= 0.0) {
+                    active.erase(active.begin() + i);
+                    lambda.erase(lambda.begin() + i);
+                }
+            }
+        }
+        for (double &val : y) {
+            val = 0.0;
+        }
+        for (size_t i = 0; i < active.size(); ++i) {
+            for (size_t k = 0; k < y.size(); ++k) {
+                y[k] += lambda[i] * p[active[i]][k];
+            }
+        }
+    }
+    return std::sqrt(dot(y, y));
+}
+
+struct Estimate {
+    double mean = NAN;
+    double stdError = NAN;
+    // Variance of the plain mean over the same number of independent
+    // replicas, divided by the variance of this estimator
+    double varianceReduction = 1.0;
+    size_t samples = 0;
+    size_t controls = 0;
+};
+
+// Estimate E[y] from samples y[i], each with a vector of control variates
+// x[i] whose expectation is known to be zero. The optimal coefficients are
+// found by least squares and the controls are only used when there are
+// enough samples to fit them without overfitting. 'baselineVariance' is the
+// variance of the plain estimator the result is compared against (e.g. the
+// independent-replica variance when samples are antithetic pair means).
+inline Estimate estimateMean(const std::vector<double> &y,
+                             const std::vector<std::vector<double>> &x,
+                             double baselineVariance) {
+    Estimate est;
+    const size_t n = y.size();
+    est.samples = n;
+    if (n == 0)
+        return est;
+    est.mean = getMean(y);
+    if (n < 2)
+        return est;
+
+    double plainVariance = getVariance(y) / n;
+    est.stdError = std::sqrt(plainVariance);
+
+    // Drop controls that never vary, they carry no information
+    std::vector<size_t> cols;
+    if (!x.empty()) {
+        assert(x.size() == n);
+        for (size_t j = 0; j < x[0].size(); ++j) {
+            double first = x[0][j];
+            for (size_t i = 1; i < n; ++i) {
+                if (x[i][j] != first) {
+                    cols.push_back(j);
+                    break;
+                }
+            }
+        }
+    }
+    const size_t k = cols.size();
+    if (k && n > 2 * (k + 1)) {
+        std::vector<double> xMean(k, 0.0);
+        for (size_t j = 0; j < k; ++j) {
+            for (size_t i = 0; i < n; ++i) {
+                xMean[j] += x[i][cols[j]];
+            }
+            xMean[j] /= n;
+        }
+        std::vector<std::vector<double>> xx(k, std::vector<double>(k, 0.0));
+        std::vector<double> xy(k, 0.0);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < k; ++j) {
+                double dj = x[i][cols[j]] - xMean[j];
+                xy[j] += dj * (y[i] - est.mean);
+                for (size_t l = 0; l < k; ++l) {
+                    xx[j][l] += dj * (x[i][cols[l]] - xMean[l]);
+                }
+            }
+        }
+        std::vector<double> beta = solveLinear(xx, xy);
+
+        double sse = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            double r = y[i] - est.mean;
+            for (size_t j = 0; j < k; ++j) {
+                r -= beta[j] * (x[i][cols[j]] - xMean[j]);
+            }
+            sse += r * r;
+        }
+        double cvMean = est.mean;
+        for (size_t j = 0; j < k; ++j) {
+            cvMean -= beta[j] * xMean[j];
+        }
+        est.mean = cvMean;
+        est.stdError = std::sqrt(sse / (n - k - 1) / n);
+        est.controls = k;
+    }
+
+    if (!std::isnan(baselineVariance) && est.stdError > 0.0) {
+        est.varianceReduction = baselineVariance / (est.stdError * est.stdError);
+    }
+    return est;
+}
+
+#endif
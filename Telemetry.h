@@ -0,0 +1,150 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef DPS_TELEMETRY_H_
+#define DPS_TELEMETRY_H_
+
+// Progress of a run, reported by a thread of its own every 'interval'
+// seconds as one line of NAME=VALUE fields. The workers each count into
+// their own counters, which only they write, so counting is a relaxed load
+// and store with no locked instruction and no cache line shared with
+// another worker. The reporter sums them with relaxed loads, so a report
+// can be a chunk behind but never blocks a worker.
+class Telemetry {
+    struct Counters {
+        std::atomic<uint64_t> events{0};
+        // Fight seconds
+        std::atomic<double> simulated{0.0};
+        std::atomic<uint64_t> jobs{0};
+        // Of the DPS of the finished replicas
+        std::atomic<uint64_t> replicas{0};
+        std::atomic<double> dpsSum{0.0};
+        std::atomic<double> dpsSquares{0.0};
+        // Keep workers' counters off each other's cache lines
+        char padding[64];
+    };
+
+    template <typename T>
+    static void bump(std::atomic<T> &counter, T delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta,
+                      std::memory_order_relaxed);
+    }
+
+    std::vector<std::unique_ptr<Counters>> workers;
+    // Written by whoever submits, which is rare
+    std::atomic<double> submittedSeconds{0.0};
+    std::atomic<uint64_t> submittedJobs{0};
+
+    const double interval;
+    FILE *const file;
+    const std::chrono::steady_clock::time_point startTime;
+
+    std::mutex mutex;
+    std::condition_variable stopCV;
+    bool stopping = false;
+    std::thread thread;
+
+    void report() {
+        uint64_t events = 0, jobs = 0, replicas = 0;
+        double simulated = 0.0, dpsSum = 0.0, dpsSquares = 0.0;
+        for (const auto &w : workers) {
+            events += w->events.load(std::memory_order_relaxed);
+            simulated += w->simulated.load(std::memory_order_relaxed);
+            jobs += w->jobs.load(std::memory_order_relaxed);
+            replicas += w->replicas.load(std::memory_order_relaxed);
+            dpsSum += w->dpsSum.load(std::memory_order_relaxed);
+            dpsSquares += w->dpsSquares.load(std::memory_order_relaxed);
+        }
+        double submitted = submittedSeconds.load(std::memory_order_relaxed);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        double wall = elapsed.count();
+
+        fprintf(file, "elapsed=%.1f done=%.1f%% simulated/s=%.0f jobs=%llu/%llu",
+                wall, submitted > 0.0 ? 100.0 * simulated / submitted : 0.0,
+                simulated / wall, (unsigned long long)jobs,
+                (unsigned long long)submittedJobs.load(std::memory_order_relaxed));
+        // Only counted with statistics
+        if (events > 0) {
+            fprintf(file, " events/s=%.0f", events / wall);
+        }
+        if (simulated > 0.0) {
+            fprintf(file, " eta=%.1f", (submitted - simulated) * wall / simulated);
+        }
+        if (showEstimate.load(std::memory_order_relaxed) && replicas > 0) {
+            double mean = dpsSum / replicas;
+            double variance = replicas > 1 ?
+                (dpsSquares - replicas * mean * mean) / (replicas - 1) : NAN;
+            fprintf(file, " replicas=%llu dps=%.2f stdError=%.2f",
+                    (unsigned long long)replicas, mean,
+                    std::sqrt(std::fmax(variance, 0.0) / replicas));
+        }
+        fprintf(file, "\n");
+        fflush(file);
+    }
+
+    void reporterMain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopCV.wait_for(lock, std::chrono::duration<double>(interval),
+                                [this]() { return stopping; })) {
+            report();
+        }
+        report();
+    }
+
+public:
+    // Whether to report the plain mean of the finished replicas, which only
+    // means something when they all share a config
+    std::atomic<bool> showEstimate{false};
+
+    Telemetry(size_t numWorkers, double interval, FILE *file) :
+        interval(interval), file(file), startTime(std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < numWorkers; ++i) {
+            workers.emplace_back(new Counters);
+        }
+        thread = std::thread(&Telemetry::reporterMain, this);
+    }
+    // With a final report
+    ~Telemetry() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            stopCV.notify_all();
+        }
+        thread.join();
+    }
+    Telemetry(const Telemetry &) = delete;
+    Telemetry &operator=(const Telemetry &) = delete;
+
+    void addWork(double seconds) {
+        double cur = submittedSeconds.load();
+        while (!submittedSeconds.compare_exchange_weak(cur, cur + seconds)) { }
+        submittedJobs.fetch_add(1);
+    }
+
+    // From worker 'worker' only
+    void addChunk(size_t worker, uint64_t events, double simulated) {
+        Counters &c = *workers[worker];
+        bump(c.events, events);
+        bump(c.simulated, simulated);
+    }
+    void addReplica(size_t worker, double dps) {
+        Counters &c = *workers[worker];
+        bump(c.replicas, uint64_t(1));
+        bump(c.dpsSum, dps);
+        bump(c.dpsSquares, dps * dps);
+    }
+    void addJob(size_t worker) {
+        bump(workers[worker]->jobs, uint64_t(1));
+    }
+};
+
+#endif
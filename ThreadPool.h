@@ -0,0 +1,150 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef DPS_THREADPOOL_H_
+#define DPS_THREADPOOL_H_
+
+// Fixed set of worker threads, each with its own deque of tasks. A worker
+// pops from the back of its own deque (so a task that resubmits itself
+// stays on the same core) and steals from the front of the others' when it
+// runs dry, so uneven tasks keep every worker busy until the last one.
+class ThreadPool {
+public:
+    using Task = std::function<void(size_t worker)>;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        // Keep workers' locks off each other's cache lines
+        char padding[64];
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    // Tasks sitting in a deque, and tasks submitted but not yet finished
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> unfinished{0};
+    std::atomic<size_t> nextWorker{0};
+    bool stopping = false;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCV;
+    std::condition_variable doneCV;
+
+    bool pop(size_t idx, Task &task) {
+        Worker &w = *workers[idx];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.tasks.empty())
+            return false;
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t idx, Task &task) {
+        const size_t n = workers.size();
+        for (size_t i = 1; i < n; ++i) {
+            Worker &w = *workers[(idx + i) % n];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (w.tasks.empty())
+                continue;
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void push(size_t idx, Task &&task) {
+        unfinished.fetch_add(1);
+        queued.fetch_add(1);
+        {
+            Worker &w = *workers[idx];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCV.notify_one();
+    }
+
+    void workerMain(size_t idx) {
+        Task task;
+        for (;;) {
+            if (pop(idx, task) || steal(idx, task)) {
+                queued.fetch_sub(1);
+                task(idx);
+                task = nullptr;
+                if (unfinished.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    doneCV.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCV.wait(lock, [this]() { return stopping || queued.load() != 0; });
+            if (stopping && queued.load() == 0)
+                return;
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t numThreads) {
+        if (numThreads == 0) {
+            numThreads = 1;
+        }
+        for (size_t i = 0; i < numThreads; ++i) {
+            workers.emplace_back(new Worker);
+        }
+        for (size_t i = 0; i < numThreads; ++i) {
+            threads.emplace_back(&ThreadPool::workerMain, this, i);
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+            sleepCV.notify_all();
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static size_t getDefaultNumThreads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    size_t getNumThreads() const { return workers.size(); }
+
+    // Submit from outside the pool. Tasks are dealt round robin to the
+    // workers' deques.
+    void submit(Task task) {
+        push(nextWorker.fetch_add(1) % workers.size(), std::move(task));
+    }
+
+    // Submit from a task running on 'worker', onto that worker's own deque
+    void submit(size_t worker, Task task) {
+        push(worker, std::move(task));
+    }
+
+    // Block until every submitted task, including tasks submitted by other
+    // tasks, has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        doneCV.wait(lock, [this]() { return unfinished.load() == 0; });
+    }
+};
+
+#endif
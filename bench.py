@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+
+# Accuracy and throughput regression suite over the dps.py presets.
+#
+# Every preset is simulated with a fixed seed. The DPS estimate is compared
+# against the stored baseline, allowing for the statistical error of both,
+# and the throughput against the stored throughput. Any significant DPS
+# shift or slowdown fails the run. Throughput is machine specific, so record
+# a baseline (--update) on the machine that runs the checks, with the binary
+# built the same way (e.g. ./build.sh -O2). The surrogate is also checked to
+# only answer queries close to its results.
+
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import dps
+
+bench_dir = os.path.dirname(os.path.abspath(__file__))
+default_baseline = os.path.join(bench_dir, "bench_baseline.json")
+
+class Result:
+    def __init__(self, name):
+        self.name = name
+        self.dps = None
+        self.stderr = None
+        self.events = None
+        self.sim_hours_per_sec = None
+        self.events_per_sec = None
+        self.peak_rss_kb = None
+
+    def to_dict(self):
+        return {
+            "dps" : self.dps,
+            "stderr" : self.stderr,
+            "sim_hours_per_sec" : self.sim_hours_per_sec,
+            "events_per_sec" : self.events_per_sec,
+            "peak_rss_kb" : self.peak_rss_kb,
+        }
+
+def fatal(msg):
+    sys.stderr.write(msg + "\n")
+    sys.exit(1)
+
+# Run the binary and return (stdout, stderr, wall seconds, peak rss in kB)
+def run_measured(cmd):
+    with tempfile.TemporaryFile() as out_file, tempfile.TemporaryFile() as err_file:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=out_file, stderr=err_file)
+        # Reap the child ourselves to get its own resource usage
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        out_file.seek(0)
+        err_file.seek(0)
+        out_text = out_file.read().decode("utf-8")
+        err_text = err_file.read().decode("utf-8")
+    if proc.returncode:
+        fatal("Command '{}' exited with status {}\n{}".format(
+              " ".join(cmd), proc.returncode, err_text))
+    return out_text, err_text, wall, usage.ru_maxrss
+
+def parse_profile(text, key):
+    for line in text.splitlines():
+        line = line.strip()
+        if line.startswith(key + ":"):
+            return line[len(key) + 1:].split()[0]
+    fatal("Missing '{}' in profile output".format(key))
+
+def bench_run(run, args):
+    cmd = [
+        args.bin,
+        "--seed={}".format(args.seed),
+        "--duration={}".format(args.duration),
+        "--replicas={}".format(args.replicas),
+        "--threads={}".format(args.threads),
+        "--control-variates",
+        "--result=estimate",
+        "--profile",
+    ]
+    for k, v in run.params.items():
+        cmd.append("{}={}".format(k, v))
+
+    result = Result(run.name)
+    best_wall = None
+    for i in range(args.repeat):
+        out, err, _, rss = run_measured(cmd)
+        sim_wall = float(parse_profile(err, "Wall time").rstrip("s"))
+        if best_wall is None or sim_wall < best_wall:
+            best_wall = sim_wall
+        result.peak_rss_kb = rss
+
+    fields = out.split()
+    result.dps = float(fields[0])
+    result.stderr = float(fields[1])
+    result.events = int(parse_profile(err, "Events"))
+    result.sim_hours_per_sec = float(args.duration) / best_wall
+    result.events_per_sec = result.events / best_wall
+    return result
+
+def compare(result, base, args):
+    failures = []
+    z = abs(result.dps - base["dps"]) / max(math.sqrt(
+        result.stderr ** 2 + base["stderr"] ** 2), 1e-9)
+    if z > args.max_z:
+        failures.append("DPS {:.2f} +- {:.2f} differs from baseline "
+                        "{:.2f} +- {:.2f} (z = {:.1f})".format(
+                        result.dps, result.stderr,
+                        base["dps"], base["stderr"], z))
+    ratio = result.sim_hours_per_sec / base["sim_hours_per_sec"]
+    if ratio < 1.0 - args.max_slowdown:
+        failures.append("Throughput {:.0f} sim hours/s is {:.0f}% below "
+                        "baseline {:.0f}".format(
+                        result.sim_hours_per_sec, (1.0 - ratio) * 100,
+                        base["sim_hours_per_sec"]))
+    return z, ratio, failures
+
+# The surrogate must answer at a stored result, and simulate (appending the
+# new result to its file) far from it
+def check_surrogate(args):
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        filename = os.path.join(tmp, "surrogate.txt")
+        with open(filename, "w") as f:
+            f.write("40.0000 0.1000\n")
+        for query, simulated in [ ([], False), (["strength=2000"], True) ]:
+            cmd = [
+                args.bin,
+                "--seed={}".format(args.seed),
+                "--duration=1",
+                "--replicas=4",
+                "--result=estimate",
+                "--surrogate={}".format(filename),
+            ] + query
+            before = os.path.getsize(filename)
+            run_measured(cmd)
+            if (os.path.getsize(filename) > before) != simulated:
+                failures.append("Query {} was {}".format(
+                                query, "answered by the surrogate" if simulated
+                                else "simulated"))
+    return failures
+
+def main():
+    parser = argparse.ArgumentParser(description="dps regression benchmark")
+    parser.add_argument("--bin", default=dps.dps)
+    parser.add_argument("--baseline", default=default_baseline)
+    parser.add_argument("--update", action="store_true",
+                        help="Rewrite the baseline with this run's results")
+    parser.add_argument("--seed", default="1")
+    parser.add_argument("--duration", default="1000")
+    parser.add_argument("--replicas", default="50")
+    parser.add_argument("--threads", default="1")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="Take the fastest of this many runs")
+    parser.add_argument("--max-z", type=float, default=4.0,
+                        help="Largest allowed DPS shift in standard errors")
+    parser.add_argument("--max-slowdown", type=float, default=0.2,
+                        help="Largest allowed throughput drop, as a fraction")
+    parser.add_argument("runs", nargs="*",
+                        help="Presets to run (default: all)")
+    args = parser.parse_args()
+
+    runs = dps.all_runs
+    if args.runs:
+        runs = [run for run in runs if run.name in args.runs]
+        if len(runs) != len(args.runs):
+            fatal("Unknown preset in {}".format(args.runs))
+
+    baseline = {}
+    if not args.update:
+        if not os.path.exists(args.baseline):
+            fatal("No baseline at {}, create one with --update".format(args.baseline))
+        with open(args.baseline, "r") as f:
+            baseline = json.load(f)
+        for key in [ "seed", "duration", "replicas" ]:
+            if str(baseline[key]) != str(getattr(args, key)):
+                fatal("Baseline was recorded with --{}={}".format(key, baseline[key]))
+
+    print("{:16} {:>16} {:>12} {:>12} {:>10} {:>6} {:>7}".format(
+          "preset", "dps", "simh/s", "events/s", "rss kB", "z", "speed"))
+
+    results = []
+    failed = False
+    for run in runs:
+        result = bench_run(run, args)
+        results.append(result)
+        z_str = ""
+        speed_str = ""
+        failures = []
+        if not args.update:
+            base = baseline["runs"].get(run.name)
+            if base is None:
+                failures.append("No baseline for preset")
+            else:
+                z, ratio, failures = compare(result, base, args)
+                z_str = "{:.1f}".format(z)
+                speed_str = "{:.2f}x".format(ratio)
+        print("{:16} {:>9.2f} +- {:<4.2f} {:>12.0f} {:>12.0f} {:>10} {:>6} {:>7}".format(
+              run.name, result.dps, result.stderr, result.sim_hours_per_sec,
+              result.events_per_sec, result.peak_rss_kb, z_str, speed_str))
+        for failure in failures:
+            print("    FAIL: " + failure)
+            failed = True
+        sys.stdout.flush()
+
+    if not args.update:
+        print("surrogate")
+        for failure in check_surrogate(args):
+            print("    FAIL: " + failure)
+            failed = True
+
+    if args.update:
+        baseline = {
+            "seed" : args.seed,
+            "duration" : args.duration,
+            "replicas" : args.replicas,
+            "runs" : { r.name : r.to_dict() for r in results },
+        }
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=4, sort_keys=True)
+            f.write("\n")
+        print("Wrote baseline to {}".format(args.baseline))
+    elif failed:
+        fatal("Regression check FAILED")
+    else:
+        print("Regression check passed")
+
+if __name__ == "__main__":
+    main()
@@ -2,5 +2,5 @@
 
 set -e
 
-g++ -std=c++11 -g -Wall -Wextra -Werror -c dps.cpp -o dps.o $@
-g++ -std=c++11 -g dps.o -o dps $@
+g++ -std=c++11 -g -pthread -Wall -Wextra -Werror -c dps.cpp -o dps.o $@
+g++ -std=c++11 -g -pthread dps.o -o dps $@
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cerrno>
 #include <cfloat>
 #include <climits>
 #include <cmath>
@@ -6,33 +7,52 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <random>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Columnar.h"
+#include "Histogram.h"
+#include "Perf.h"
+#include "Random.h"
+#include "Sobol.h"
+#include "Stats.h"
 #include "StrView.h"
+#include "Telemetry.h"
+#include "ThreadPool.h"
 
 ////////////////////////////////////////////////////////////////////////////////
+// DeepWounds fires for the earliest deep wounds tick, and ticks every
+// target that is due then.
+// Aura fires for the earliest aura tick or expiry.
+// CooldownReady fires at the earliest time a rotation cooldown becomes
+// usable. It is kept last so that other events at the same time still see
+// the cooldown as not ready.
 #define EVENT_LIST                                                             \
     X(MainSwing)                                                               \
     X(OffSwing)                                                                \
     X(AngerManagement)                                                         \
-    X(DeepWoundsTick)                                                          \
-    X(BloodrageTick)                                                           \
-    X(OverpowerProcExpire)                                                     \
-    X(DeathWishExpire)                                                         \
-    X(MortalStrikeCD)                                                          \
-    X(BloodthirstCD)                                                           \
-    X(WhirlwindCD)                                                             \
-    X(OverpowerCD)                                                             \
+    X(DeepWounds)                                                              \
+    X(Aura)                                                                    \
     X(BloodrageCD)                                                             \
-    X(BerserkerRageCD)                                                         \
-    X(DeathWishCD)                                                             \
     X(StanceCD)                                                                \
-    X(GlobalCD)
+    X(CooldownReady)
 
 enum EventKind {
     #define X(NAME) EK_##NAME,
@@ -57,6 +77,46 @@ const size_t NumEventKinds = 0
     ;
 ////////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////////
+// Cooldowns gating the rotation. They don't get events of their own, each
+// one is a ready-at time plus a bit in DPS::readyMask.
+#define COOLDOWN_LIST                                                          \
+    X(MortalStrike)                                                            \
+    X(Bloodthirst)                                                             \
+    X(Whirlwind)                                                               \
+    X(Overpower)                                                               \
+    X(BerserkerRage)                                                           \
+    X(DeathWish)                                                               \
+    X(Global)
+
+enum CooldownKind {
+    #define X(NAME) CD_##NAME,
+    COOLDOWN_LIST
+    #undef X
+};
+
+const char *getCooldownName(CooldownKind cd) {
+    switch (cd) {
+    #define X(NAME) case CD_##NAME: return #NAME;
+    COOLDOWN_LIST
+    #undef X
+    }
+    assert(0);
+    return "";
+}
+
+const size_t NumCooldowns = 0
+    #define X(NAME) + 1
+    COOLDOWN_LIST
+    #undef X
+    ;
+
+constexpr unsigned getCooldownBit(CooldownKind cd) {
+    return 1u << cd;
+}
+const unsigned AllCooldownBits = (1u << NumCooldowns) - 1;
+////////////////////////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////////////////////////
 #define HIT_KIND_LIST                                                          \
     X(Miss)                                                                    \
@@ -121,6 +181,33 @@ const size_t NumDamageSources = 0
     ;
 ////////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////////
+#define ATTACK_TABLE_LIST \
+    X(White) \
+    X(Special) \
+    X(Overpower)
+
+enum AttackTableKind {
+    #define X(NAME) AT_##NAME,
+    ATTACK_TABLE_LIST
+    #undef X
+};
+const char *getAttackTableName(AttackTableKind at) {
+    switch (at) {
+    #define X(NAME) case AT_##NAME: return #NAME;
+    ATTACK_TABLE_LIST
+    #undef X
+    }
+    assert(0);
+    return "";
+}
+const size_t NumAttackTables = 0
+    #define X(NAME) + 1
+    ATTACK_TABLE_LIST
+    #undef X
+    ;
+////////////////////////////////////////////////////////////////////////////////
+
 FILE *logFile = nullptr;
 #if 0
 void log(const char *format, ...) {
@@ -140,35 +227,159 @@ void log(const char *format, ...) {
     } while(0)
 #endif
 
+// What a fight records besides its total damage. Each level is a separate
+// instantiation of the simulation, so a fight only pays for what it records.
+//   None:   total damage only
+//   Totals: the FightStats counters, for control variates and detailed results
+//   Full:   Totals plus the histograms
+//   Trace:  Full plus the event log
+#define INSTRUMENTATION_LIST                                                   \
+    X(None)                                                                    \
+    X(Totals)                                                                  \
+    X(Full)                                                                    \
+    X(Trace)
+
+enum Instrumentation {
+    #define X(NAME) IN_##NAME,
+    INSTRUMENTATION_LIST
+    #undef X
+};
+
+const char *getInstrumentationName(Instrumentation in) {
+    switch (in) {
+        #define X(NAME) case IN_##NAME: return #NAME;
+        INSTRUMENTATION_LIST
+        #undef X
+    }
+    assert(0);
+    return "";
+}
+
+// Log from the simulation, compiled out below IN_Trace
+#define trace(...)                         \
+    do {                                   \
+        if (In >= IN_Trace) {              \
+            log(__VA_ARGS__);              \
+        }                                  \
+    } while(0)
+
 // TODO replace most uses of unsigned with size_t - should be faster?
 
-using RNG = std::minstd_rand;
+using RNG = RandomStream;
+
+////////////////////////////////////////////////////////////////////////////////
+// Every call site that draws random numbers gets its own stream, so a change
+// in how often one site draws doesn't shift the numbers seen by the others.
+// The attack table streams come first, in AttackTableKind order.
+#define RANDOM_STREAM_LIST                                                     \
+    X(WhiteTable)                                                              \
+    X(SpecialTable)                                                            \
+    X(OverpowerTable)                                                          \
+    X(WeaponDamage)                                                            \
+    X(SwordSpec)                                                               \
+    X(UnbridledWrath)
+
+enum RandomStreamKind {
+    #define X(NAME) RS_##NAME,
+    RANDOM_STREAM_LIST
+    #undef X
+};
+const size_t NumRandomStreams = 0
+    #define X(NAME) + 1
+    RANDOM_STREAM_LIST
+    #undef X
+    ;
+static_assert(int(RS_WhiteTable) == int(AT_White) &&
+              int(RS_SpecialTable) == int(AT_Special) &&
+              int(RS_OverpowerTable) == int(AT_Overpower),
+              "Attack table streams must match AttackTableKind");
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Procs with a fixed chance per attempt. Each draws from the random stream
+// of the same name.
+#define PROC_LIST                                                              \
+    X(SwordSpec)                                                               \
+    X(UnbridledWrath)
+
+enum ProcKind {
+    #define X(NAME) PK_##NAME,
+    PROC_LIST
+    #undef X
+};
+const size_t NumProcs = 0
+    #define X(NAME) + 1
+    PROC_LIST
+    #undef X
+    ;
+
+const char *getProcName(ProcKind pk) {
+    switch (pk) {
+    #define X(NAME) case PK_##NAME: return #NAME;
+    PROC_LIST
+    #undef X
+    }
+    assert(0);
+    return "";
+}
+
+RandomStreamKind getProcStream(ProcKind pk) {
+    switch (pk) {
+    #define X(NAME) case PK_##NAME: return RS_##NAME;
+    PROC_LIST
+    #undef X
+    }
+    assert(0);
+    return RandomStreamKind(0);
+}
+////////////////////////////////////////////////////////////////////////////////
 
+// The random streams of one fight. They're addressed by (seed, config id,
+// replica, stream kind) only, so a fight's numbers are the same however the
+// replicas are spread over threads or processes. An antithetic context
+// mirrors every draw (u -> 1 - u), so a pair of replicas with the same
+// seed, one of them antithetic, has negatively correlated rolls.
 struct Context {
-    RNG rng;
+    RNG streams[NumRandomStreams];
+
+    Context(unsigned seed, unsigned configId, unsigned replica,
+            bool antithetic = false) {
+        uint64_t key = (uint64_t(configId) << 32) | seed;
+        for (size_t i = 0; i < NumRandomStreams; ++i) {
+            streams[i].init(key, (uint64_t(replica) << 32) | i, antithetic);
+        }
+    }
 
-    Context(unsigned seed) : rng(seed) { }
+    RNG &get(RandomStreamKind rs) {
+        return streams[rs];
+    }
 
-    uint64_t rand() {
-        return rng();
+    uint64_t rand(RandomStreamKind rs) {
+        return streams[rs]();
     }
-    bool chance(double ch) {
+    bool chance(RandomStreamKind rs, double ch) {
         if (ch >= 1.0)
             return true;
         if (ch <= 0.0)
             return false;
-        // FIXME this doesn't account for RNG::min
-        return uint64_t(ch * RNG::max()) > rand();
+        return uint64_t(ch * (uint64_t(RNG::max()) + 1)) > rand(rs);
+    }
+    // Number of attempts up to and including the first success, for a
+    // chance with log2(1 - chance) = log2Miss, drawn by inversion. The
+    // chance must be greater than zero.
+    uint32_t geometric(RandomStreamKind rs, double log2Miss) {
+        double u = (rand(rs) + 0.5) / (double(RNG::max()) + 1.0);
+        double attempts = std::floor(std::log2(u) / log2Miss) + 1.0;
+        return attempts < double(UINT32_MAX) ? uint32_t(attempts) : UINT32_MAX;
     }
-};
-
-struct DPS;
-template <EventKind EK, unsigned NumTicks, unsigned Period>
-struct Tick {
-    unsigned ticks = 0;
 
-    void start(DPS &dps);
-    void tick(DPS &dps);
+    uint64_t getNumDraws() const {
+        uint64_t result = 0;
+        for (const RNG &stream : streams) {
+            result += stream.getNumDraws();
+        }
+        return result;
+    }
 };
 
 bool verbose = false;
@@ -179,9 +390,97 @@ unsigned bloodthirstCost = 30;
 unsigned deathWishCost = 10;
 unsigned whirlwindCost = 25;
 unsigned overpowerCost = 5;
+unsigned maxRage = 100;
 double globalCDDuration = 1.5;
-double stanceCDDuration = 1.5; // TODO is this right?
-double overpowerProcDuration = 5; // TODO is this right?
+double deathWishDuration = 30;
+double deepWoundsPeriod = 3;
+unsigned deepWoundsNumTicks = 4;
+unsigned whirlwindMaxTargets = 4;
+
+// Targets have a bit each in the per-target masks
+const size_t MaxTargets = 16;
+static_assert(MaxTargets <= 32, "Targets are a 32 bit mask");
+
+// Anything faster would take forever to simulate
+const double MinSwingTime = 0.1;
+
+inline uint32_t getTargetBit(unsigned target) {
+    return uint32_t(1) << target;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+// Auras ///////////////////////////////////////////////////////////////////////
+// Buffs and effects over time on the player. Debuffs on the targets are
+// kept per target in DPS instead. An aura with a PERIOD ticks NUM_TICKS
+// times and ends with the last tick, otherwise it ends after DURATION (0 for
+// no limit) or when its last charge is used (CHARGES, 0 for no charges).
+// The modifiers apply while the aura is up. Auras whose timers fall on the
+// same time are handled in list order.
+#define AURA_LIST                                                              \
+    /* NAME, DURATION, PERIOD, NUM_TICKS, CHARGES, */                          \
+    /*     DAMAGE_MUL, HASTE_MUL, ATTACK_POWER, TICK_RAGE */                   \
+    X(Bloodrage, 0, 1, 10, 0,                                                  \
+      1.0, 1.0, 0, 1)                                                          \
+    /* Up while any target's overpower proc is. Duration set by the */         \
+    /* overpowerProcDuration param */                                          \
+    X(OverpowerProc, 5, 0, 0, 0,                                               \
+      1.0, 1.0, 0, 0)                                                          \
+    X(DeathWish, deathWishDuration, 0, 0, 0,                                   \
+      1.2, 1.0, 0, 0)                                                          \
+    /* Haste depends on the talent, see Config */                              \
+    X(Flurry, 0, 0, 0, 3,                                                      \
+      1.0, 1.0, 0, 0)
+
+enum AuraKind {
+    #define X(NAME, ...) AU_##NAME,
+    AURA_LIST
+    #undef X
+};
+
+const char *getAuraName(AuraKind au) {
+    switch (au) {
+    #define X(NAME, ...) case AU_##NAME: return #NAME;
+    AURA_LIST
+    #undef X
+    }
+    assert(0);
+    return "";
+}
+
+const size_t NumAuras = 0
+    #define X(NAME, ...) + 1
+    AURA_LIST
+    #undef X
+    ;
+static_assert(NumAuras <= 32, "Active auras are a 32 bit mask");
+
+inline uint32_t getAuraBit(AuraKind au) {
+    return uint32_t(1) << au;
+}
+
+struct AuraInfo {
+    double duration;
+    double period;
+    unsigned numTicks;
+    unsigned charges;
+    double damageMul;
+    double hasteMul;
+    unsigned attackPower;
+    unsigned tickRage;
+
+    bool hasModifiers() const {
+        return damageMul != 1.0 || hasteMul != 1.0 || attackPower != 0;
+    }
+};
+
+const AuraInfo baseAuraInfos[NumAuras] = {
+    #define X(NAME, DURATION, PERIOD, NUM_TICKS, CHARGES,                      \
+              DAMAGE_MUL, HASTE_MUL, ATTACK_POWER, TICK_RAGE)                  \
+        { DURATION, PERIOD, NUM_TICKS, CHARGES,                                \
+          DAMAGE_MUL, HASTE_MUL, ATTACK_POWER, TICK_RAGE },
+    AURA_LIST
+    #undef X
+};
 ////////////////////////////////////////////////////////////////////////////////
 
 // Params //////////////////////////////////////////////////////////////////////
@@ -190,6 +489,10 @@ double overpowerProcDuration = 5; // TODO is this right?
     X(dualWield, bool, false)                                                  \
     X(enemyLevel, unsigned, 63)                                                \
     X(armorMul, double, 0.80)                                                  \
+    /* Enemies in range, 1 to MaxTargets. Whirlwind hits up to 4 of */         \
+    /* them, everything else hits the first (or the one that dodged, */        \
+    /* for overpower). */                                                      \
+    X(numTargets, unsigned, 1)                                                 \
                                                                                \
     /* Stats */                                                                \
                                                                                \
@@ -233,6 +536,22 @@ double overpowerProcDuration = 5; // TODO is this right?
     X(flurryLevel, unsigned, 0)                                                \
     X(improvedBerserkerRageLevel, unsigned, 0)                                 \
     X(bloodthirstLevel, unsigned, 0)                                           \
+                                                                               \
+    /* Rotation, see --tune */                                                 \
+                                                                               \
+    /* Whirlwind is used above this much rage even while saving for */         \
+    /* overpower, or while an overpower proc is up if this much rage */        \
+    /* is left over what a stance swap keeps */                                \
+    X(whirlwindMinRage, unsigned, 70)                                          \
+    X(whirlwindOverpowerMargin, unsigned, 10)                                  \
+    /* Seconds to stay in battle stance after overpower, waiting for */        \
+    /* another dodge, before swapping back */                                  \
+    X(overpowerStanceHold, double, 0.0)                                        \
+                                                                               \
+    /* Uncertain mechanics */                                                  \
+                                                                               \
+    X(stanceCDDuration, double, 1.5) /* TODO is this right? */                 \
+    X(overpowerProcDuration, double, 5.0) /* TODO is this right? */            \
 
 void printVal(FILE *file, double val) {
     fprintf(file, "%.2f", val);
@@ -249,6 +568,28 @@ struct Params {
     PARAM_LIST
     #undef X
 
+    // Why the values are outside the limits the simulation supports, or
+    // empty if they aren't
+    std::string getError() const {
+        std::ostringstream error;
+        if (numTargets < 1 || numTargets > MaxTargets) {
+            error << "numTargets must be between 1 and " << MaxTargets;
+        } else if (!(mainSwingTime >= MinSwingTime) || !(offSwingTime >= MinSwingTime)) {
+            error << "swing times must be at least " << MinSwingTime << "s";
+        } else if (mainWeaponDamageMin > mainWeaponDamageMax) {
+            error << "mainWeaponDamageMin is above mainWeaponDamageMax";
+        } else if (offWeaponDamageMin > offWeaponDamageMax) {
+            error << "offWeaponDamageMin is above offWeaponDamageMax";
+        } else if (whirlwindMinRage < whirlwindCost) {
+            error << "whirlwindMinRage must be at least the Whirlwind cost, "
+                  << whirlwindCost;
+        }
+        return error.str();
+    }
+    bool isValid() const {
+        return getError().empty();
+    }
+
     void print(FILE *file) const {
         fprintf(file, "Params:\n");
         #define X(NAME, TYPE, VALUE) \
@@ -264,8 +605,12 @@ struct Params {
 struct AttackTable {
     static const size_t TableSize = NumHitKinds - 1;
 
+    // Crit is the last boundary, so the crit chance (which changes during a
+    // fight) is passed to roll as a threshold and the rest of the table can
+    // be shared.
+    static_assert(HK_Crit == TableSize - 1, "Crit must be the last boundary");
+
     uint64_t table[TableSize] = { 0 };
-    mutable size_t counts[NumHitKinds] = { 0 };
 
     void set(HitKind hk, double chance) {
         if (chance < 0.0) {
@@ -284,15 +629,33 @@ struct AttackTable {
         }
     }
 
-    HitKind roll(Context &ctx) const {
-        uint64_t roll = ctx.rand();
-        size_t i;
-        for (i = 0; i < TableSize; ++i) {
+    uint64_t getCritThreshold(double chance) const {
+        if (chance < 0.0) {
+            chance = 0.0;
+        }
+        return table[HK_Crit - 1] + uint64_t(chance * (RNG::max() - RNG::min()));
+    }
+
+    double getChance(HitKind hk, uint64_t critThreshold) const {
+        const uint64_t end = uint64_t(RNG::max()) + 1;
+        const size_t idx = size_t(hk);
+        auto getBound = [&](size_t i) {
+            return std::min(i == HK_Crit ? critThreshold : table[i], end);
+        };
+        uint64_t lo = idx == 0 ? RNG::min() : getBound(idx - 1);
+        uint64_t hi = idx == TableSize ? end : getBound(idx);
+        if (hi <= lo)
+            return 0.0;
+        return double(hi - lo) / (end - RNG::min());
+    }
+
+    HitKind roll(RNG &rng, uint64_t critThreshold) const {
+        uint64_t roll = rng();
+        for (size_t i = 0; i < HK_Crit; ++i) {
             if (roll < table[i])
-                break;
+                return HitKind(i);
         }
-        ++(counts[i]);
-        return HitKind(i);
+        return roll < critThreshold ? HK_Crit : HK_Hit;
     }
 
     void print(FILE *file) const {
@@ -313,11 +676,56 @@ struct AttackTable {
         out << "}\n";
 #endif
     }
-    void printStats(FILE *file) const {
+    void dump() const;
+};
+void AttackTable::dump() const { print(stderr); }
+
+// Roll counts of one attack table over a fight
+struct HitStats {
+    size_t counts[NumHitKinds] = { 0 };
+
+    // Expected number of each hit kind over the rolls made so far. Rolls
+    // since the last change to the crit chance are folded in lazily, so
+    // rolling doesn't pay for this.
+    double expected[NumHitKinds] = { 0 };
+    size_t expectedRolls = 0;
+
+    size_t getNumRolls() const {
         size_t total = 0;
         for (size_t count : counts) {
             total += count;
         }
+        return total;
+    }
+
+    void updateExpected(const AttackTable &table, uint64_t critThreshold) {
+        size_t total = getNumRolls();
+        size_t rolls = total - expectedRolls;
+        if (!rolls)
+            return;
+        for (size_t i = 0; i < NumHitKinds; ++i) {
+            expected[i] += rolls * table.getChance(HitKind(i), critThreshold);
+        }
+        expectedRolls = total;
+    }
+
+    void add(const HitStats &other) {
+        for (size_t i = 0; i < NumHitKinds; ++i) {
+            counts[i] += other.counts[i];
+            expected[i] += other.expected[i];
+        }
+        expectedRolls += other.expectedRolls;
+    }
+
+    // Observed minus expected number of rolls of the given kind. Only
+    // accurate after updateExpected.
+    double getDeviation(HitKind hk) const {
+        assert(expectedRolls == getNumRolls());
+        return counts[hk] - expected[hk];
+    }
+
+    void print(FILE *file) const {
+        size_t total = getNumRolls();
         fprintf(file, "{\n");
         for (size_t i = 0; i < NumHitKinds; ++i) {
             fprintf(file, "    %s: %.2f%%\n",
@@ -326,11 +734,11 @@ struct AttackTable {
         }
         fprintf(file, "}\n");
     }
-    void dump() const;
 };
-void AttackTable::dump() const { print(stderr); }
 
-struct DPS {
+// Constants derived from Params. Immutable once constructed, so all the
+// replicas of a configuration share a single copy.
+struct Config {
     const Params p;
 
     const unsigned levelDelta = p.enemyLevel - 60;
@@ -354,177 +762,895 @@ struct DPS {
     const double hitBonus = p.hitBonus * 0.01;
     const double critBonus = p.critBonus * 0.01;
 
+    // Before the tables clamp them at 0, so hit past the point where the
+    // white miss chance reaches 0 does nothing
+    const double specialMissChance = 0.05
+                                     + levelDelta * 0.01
+                                     + (levelDelta > 2 ? 0.01 : 0.0)
+                                     - hitBonus;
+    const double whiteMissChance = specialMissChance + (p.dualWield ? 0.19 : 0.0);
+
     const double specialAttackWeaponSpeed = !p.dualWield ? 3.3 :
                                             p.mainHandDagger ? 1.7 : 2.4;
 
     const unsigned stanceSwapMaxRage = 5 * p.tacticalMasteryLevel;
 
-    unsigned strength = p.strength;
-    unsigned agility = p.agility;
-    unsigned bonusAttackPower = p.bonusAttackPower;
-
-    bool berserkerStance = true;
-
-    double events[NumEventKinds];
-    double curTime = 0.0;
-
-    // TODO use fixed precision fraction type for this
-    unsigned rage = 0;
-
-    double deepWoundsTickDamage = 0;
-    unsigned flurryCharges = 0;
-
-    Tick<EK_DeepWoundsTick, 4, 3> deepWoundsTicks;
-    Tick<EK_BloodrageTick, 10, 1> bloodrageTicks;
+    const unsigned whirlwindTargets = std::min(p.numTargets, whirlwindMaxTargets);
 
-    Context ctx;
+    // Cooldowns of the abilities this build can use at all
+    const unsigned rotationCooldowns =
+        (p.mortalStrikeLevel ? getCooldownBit(CD_MortalStrike) : 0) |
+        (p.bloodthirstLevel ? getCooldownBit(CD_Bloodthirst) : 0) |
+        getCooldownBit(CD_Whirlwind) |
+        getCooldownBit(CD_Overpower) |
+        (p.improvedBerserkerRageLevel ? getCooldownBit(CD_BerserkerRage) : 0) |
+        (p.deathWishLevel ? getCooldownBit(CD_DeathWish) : 0);
 
-    std::uniform_int_distribution<unsigned> mainWeaponDamageDist;
-    std::uniform_int_distribution<unsigned> offWeaponDamageDist;
+    const double hasteMul = 1.0 + 0.01 * p.hasteBonus;
 
-    AttackTable whiteTable;
-    AttackTable specialTable;
-    AttackTable overpowerTable;
+    const double mainWeaponDamageAvg = p.mainWeaponDamageMin +
+        double(p.mainWeaponDamageMax - p.mainWeaponDamageMin) / 2;
+    const double offWeaponDamageAvg = p.offWeaponDamageMin +
+        double(p.offWeaponDamageMax - p.offWeaponDamageMin) / 2;
 
-    struct DamageStat {
-        unsigned long damage = 0;
-        unsigned count = 0;
-    };
-    DamageStat damageStats[NumDamageSources];
+    AttackTable tables[NumAttackTables];
 
-    unsigned wastedRageSpillOver = 0;
-    unsigned wastedRageStanceSwap = 0;
-    unsigned spentRage = 0;
+    AuraInfo auras[NumAuras];
+    // Auras with damage, haste or stat modifiers
+    uint32_t modifierAuras = 0;
 
-    DPS(const Params &params, unsigned seed) :
-        p(params), ctx(seed),
-        mainWeaponDamageDist(p.mainWeaponDamageMin, p.mainWeaponDamageMax),
-        offWeaponDamageDist(p.offWeaponDamageMin, p.offWeaponDamageMax) {
+    double procChances[NumProcs];
+    // log2(1 - chance), for drawing the attempts until the next proc
+    double procLog2Miss[NumProcs];
 
-        for (double &event : events) {
-            event = DBL_MAX;
-        }
+    // Lowest rage above r at which some ability's rage check can pass,
+    // maxRage + 1 if there is none
+    unsigned nextRageThreshold[101];
 
+    Config(const Params &params) : p(params) {
+        assert(p.isValid());
         double dodgeChance = 0.05 + (levelDelta * 0.005);
-        double specialMissChance = 0.05
-                                   + levelDelta * 0.01
-                                   + (levelDelta > 2 ? 0.01 : 0.0)
-                                   - hitBonus;
 
-        whiteTable.set(HK_Miss, specialMissChance + (p.dualWield ? 0.19 : 0.0));
+        AttackTable &whiteTable = tables[AT_White];
+        whiteTable.set(HK_Miss, whiteMissChance);
         whiteTable.set(HK_Dodge, dodgeChance);
         whiteTable.set(HK_Glance, 0.1 + 0.1 * levelDelta);
 
+        AttackTable &specialTable = tables[AT_Special];
         specialTable.set(HK_Miss, specialMissChance);
         specialTable.set(HK_Dodge, dodgeChance);
 
+        AttackTable &overpowerTable = tables[AT_Overpower];
         overpowerTable.set(HK_Miss, specialMissChance);
 
-        updateCritChance();
+        for (size_t i = 0; i < NumAuras; ++i) {
+            auras[i] = baseAuraInfos[i];
+        }
+        auras[AU_Flurry].hasteMul = flurryBuff;
+        auras[AU_OverpowerProc].duration = p.overpowerProcDuration;
+        for (size_t i = 0; i < NumAuras; ++i) {
+            if (auras[i].hasModifiers()) {
+                modifierAuras |= getAuraBit(AuraKind(i));
+            }
+        }
 
-        events[EK_MainSwing] = 0.0;
-        if (p.dualWield) {
-            events[EK_OffSwing] = 0.0;
+        procChances[PK_SwordSpec] = swordSpecChance;
+        procChances[PK_UnbridledWrath] = unbridledWrathChance;
+        for (size_t i = 0; i < NumProcs; ++i) {
+            // Talents past their maximum level can make a chance exceed 1
+            procChances[i] = std::min(std::max(procChances[i], 0.0), 1.0);
+            procLog2Miss[i] = std::log2(1.0 - procChances[i]);
         }
-        if (p.angerManagementLevel) {
-            events[EK_AngerManagement] = 0.0;
+
+        const unsigned rageThresholds[] = {
+            mortalStrikeCost, bloodthirstCost, deathWishCost, whirlwindCost,
+            overpowerCost, p.whirlwindMinRage,
+            stanceSwapMaxRage + p.whirlwindOverpowerMargin + 1
+        };
+        for (unsigned r = 0; r <= maxRage; ++r) {
+            nextRageThreshold[r] = maxRage + 1;
+            for (unsigned t : rageThresholds) {
+                if (t > r) {
+                    nextRageThreshold[r] = std::min(nextRageThreshold[r], t);
+                }
+            }
         }
-        events[EK_BloodrageCD] = 0.0;
     }
 
-    unsigned long getTotalDamage() const {
-        unsigned long result = 0;
+    double getCritChance(AttackTableKind at, bool berserkerStance,
+                         unsigned agility) const {
+        return + 0.05
+               + (berserkerStance ? 0.03 : 0.0)
+               + ((0.01 / 20) * agility)
+               + fixedCritBonus
+               + critBonus
+               + (at == AT_Overpower ? 0.25 * p.improvedOverpowerLevel : 0.0);
+    }
+};
+
+// About 6% wide buckets, from 1 to 65536 damage
+using DamageHistogram = LogLinearHistogram<0, 16, 4>;
+// Rage is at most 100
+using RageHistogram = LinearHistogram<101>;
+// About 6% wide buckets, from 1/16 to 1024 seconds
+using IntervalHistogram = LogLinearHistogram<-4, 10, 4>;
+
+// Statistics accumulated over a fight. Only written, never read, by the
+// simulation itself, so they're kept away from the hot state.
+struct FightStats {
+    struct DamageStat {
+        double damage = 0.0;
+        unsigned count = 0;
+    };
+    DamageStat damageStats[NumDamageSources];
+
+    // Damage done to each target, the first numTargets entries used
+    unsigned numTargets = 1;
+    double targetDamage[MaxTargets] = { 0.0 };
+
+    HitStats hitStats[NumAttackTables];
+
+    struct ProcStat {
+        size_t attempts = 0;
+        size_t procs = 0;
+
+        double getDeviation(double chance) const {
+            return procs - attempts * chance;
+        }
+    };
+    ProcStat procStats[NumProcs];
+
+    unsigned wastedRageSpillOver = 0;
+    unsigned wastedRageStanceSwap = 0;
+    unsigned spentRage = 0;
+
+    size_t numEvents = 0;
+    // Rotation evaluations, and those that used no ability
+    size_t numEvaluations = 0;
+    size_t numIdleEvaluations = 0;
+
+    // Simulated seconds
+    double duration = 0.0;
+
+    double getTotalDamage() const {
+        double result = 0.0;
         for (const DamageStat &d : damageStats) {
             result += d.damage;
         }
         return result;
     }
 
-    bool isActive(EventKind ek) const {
-        return events[ek] != DBL_MAX;
-    }
-    void clear(EventKind ek) {
-        events[ek] = DBL_MAX;
+    // Accumulate another fight's statistics, e.g. to total the replicas
+    void add(const FightStats &other) {
+        for (size_t i = 0; i < NumDamageSources; ++i) {
+            damageStats[i].damage += other.damageStats[i].damage;
+            damageStats[i].count += other.damageStats[i].count;
+        }
+        numTargets = std::max(numTargets, other.numTargets);
+        for (size_t i = 0; i < MaxTargets; ++i) {
+            targetDamage[i] += other.targetDamage[i];
+        }
+        for (size_t i = 0; i < NumAttackTables; ++i) {
+            hitStats[i].add(other.hitStats[i]);
+        }
+        for (size_t i = 0; i < NumProcs; ++i) {
+            procStats[i].attempts += other.procStats[i].attempts;
+            procStats[i].procs += other.procStats[i].procs;
+        }
+        wastedRageSpillOver += other.wastedRageSpillOver;
+        wastedRageStanceSwap += other.wastedRageStanceSwap;
+        spentRage += other.spentRage;
+        numEvents += other.numEvents;
+        numEvaluations += other.numEvaluations;
+        numIdleEvaluations += other.numIdleEvaluations;
+        duration += other.duration;
     }
+};
 
-    void swapStance() {
-        log("    %s stance\n", (berserkerStance ? "Battle" : "Berserker"));
-        assert(!isActive(EK_StanceCD));
-        events[EK_StanceCD] = curTime + stanceCDDuration;
-        berserkerStance = !berserkerStance;
-        updateCritChance();
-        if (rage > stanceSwapMaxRage) {
-            auto waste = rage - stanceSwapMaxRage;
-            wastedRageStanceSwap += waste;
-            log("    stance swap wasted %u rage\n", waste);
-            rage = stanceSwapMaxRage;
+// Distributions, in fixed memory however long the fight. They're some
+// 20 KB, so they're kept apart from FightStats and only the Full and Trace
+// fights allocate them.
+struct FightHistograms {
+    DamageHistogram damage[NumDamageSources];
+    // Seconds spent at each rage level
+    RageHistogram rageTime;
+    // Seconds between special attacks
+    IntervalHistogram specialIntervals;
+
+    void merge(const FightHistograms &other) {
+        for (size_t i = 0; i < NumDamageSources; ++i) {
+            damage[i].merge(other.damage[i]);
         }
+        rageTime.merge(other.rageTime);
+        specialIntervals.merge(other.specialIntervals);
     }
-    void trySwapStance() {
-        if (!isActive(EK_StanceCD)) {
-            swapStance();
+
+    // One 'histogram,low,high,count' line per non-empty bucket. The counts
+    // add up, so the files of several shards can simply be concatenated.
+    void print(FILE *file) const {
+        fprintf(file, "histogram,low,high,count\n");
+        for (size_t i = 0; i < NumDamageSources; ++i) {
+            std::string name = std::string("damage.") +
+                               getDamageSourceName(DamageSource(i));
+            damage[i].printCsv(file, name.c_str());
         }
+        rageTime.printCsv(file, "rageTime");
+        specialIntervals.printCsv(file, "specialIntervals");
     }
+};
 
-    void addDamage(DamageSource source, double damage) {
-        log("    %.2f damage\n", damage);
-        damageStats[source].damage += (unsigned long)damage;
-        damageStats[source].count += 1;
-    }
+// Hits whose damage hasn't been added up yet. The event loop stores each
+// hit's unmultiplied damage (weapon roll, attack power and flat bonus) and
+// the product of its multipliers, and flushHits() multiplies and sums a
+// block at a time, away from the branchy event code. The rolls stay in the
+// event loop, as white hits share their stream and need their damage at
+// once for rage. Hit n of a fight is summed into lane n % Lanes, each lane
+// in hit order, so the lanes add up in vector registers and where the
+// blocks end doesn't change a bit of the result.
+struct HitBuffer {
+    static_assert(NumDamageSources <= 256, "Sources are stored in a byte");
+    static_assert(MaxTargets <= 256, "Targets are stored in a byte");
+    static const size_t Size = 64;
+    static const size_t Lanes = 4;
+    static_assert(Size % Lanes == 0, "Full blocks keep the lanes in place");
+    double raw[Size];
+    double mul[Size];
+    uint8_t source[Size];
+    uint8_t target[Size];
+    size_t count = 0;
 
-    // TODO add speed enchant as a param
-    double getMainSwingTime() const {
-        return p.mainSwingTime / ((flurryCharges ? flurryBuff : 1.0) * (1.0 + 0.01 * p.hasteBonus));
-    }
-    double getOffSwingTime() const {
-        return p.offSwingTime / ((flurryCharges ? flurryBuff : 1.0) * (1.0 + 0.01 * p.hasteBonus));
+    static double getDamage(double raw, double mul) {
+        return raw * mul;
     }
+};
 
-    double getCritChance() const {
-        return + 0.05
-               + (berserkerStance ? 0.03 : 0.0)
-               + ((0.01 / 20) * agility)
-               + fixedCritBonus
-               + critBonus;
-    }
+// A single fight. The members are laid out hottest first: the event timers
+// and the per-fight state that nearly every event reads or writes come
+// first and are cache line aligned, followed by the per-fight RNG, then the
+// shared Config and the statistics.
+template <Instrumentation In>
+struct alignas(64) DPS {
+    static constexpr bool recordTotals = In >= IN_Totals;
+    static constexpr bool recordHistograms = In >= IN_Full;
 
-    // TODO how can we make sure that things like this stay in sync? E.g.
-    // any time agility is updated, this method must be called.
-    void updateCritChance() {
-        double ch = getCritChance();
-        whiteTable.set(HK_Crit, ch);
-        specialTable.set(HK_Crit, ch);
-        overpowerTable.set(HK_Crit, ch + 0.25 * p.improvedOverpowerLevel);
-    }
-    double getAttackPower() const {
-        return strength * 2 + battleShoutAttackPower + bonusAttackPower;
-    }
+    // Hot state ///////////////////////////////////////////////////////////////
+    double events[NumEventKinds];
 
-    void applyDeepWounds() {
-        if (p.deepWoundsLevel == 0)
-            return;
-        deepWoundsTicks.start(*this);
-        deepWoundsTickDamage = getWeaponDamage(true, /*average=*/true) *
-                               deepWoundsTickMul *
-                               (isActive(EK_DeathWishExpire) ? 1.2 : 1.0);
-    }
-    void applyFlurry() {
-        if (!p.flurryLevel)
-            return;
-        flurryCharges = 3;
+    double curTime = 0.0;
+
+    // The one statistic every level keeps, up to the last flushHits(), in
+    // the hit buffer's lanes. The next hit to be flushed goes to lane
+    // nextLane.
+    double damageLanes[HitBuffer::Lanes] = { 0.0 };
+    unsigned nextLane = 0;
+
+    uint64_t critThresholds[NumAttackTables] = { 0 };
+
+    // Rotation cooldowns. A cleared bit in readyMask means the cooldown is
+    // running until readyAt. The bits are set again lazily, by the first
+    // event after nextReadyAt or by the CooldownReady event.
+    double readyAt[NumCooldowns] = { 0.0 };
+    double nextReadyAt = DBL_MAX;
+    unsigned readyMask = AllCooldownBits;
+
+    // Set when something changed that can make an ability usable since the
+    // rotation was last evaluated. The rotation is a function of this state
+    // only, so while it's clear evaluating again would do nothing.
+    bool rotationDirty = true;
+
+    // TODO use fixed precision fraction type for this
+    unsigned rage = 0;
+    // When rage last changed, and the last special attack
+    double rageSince = 0.0;
+    double lastSpecialTime = -1.0;
+
+    // Stats that change during a fight. Only ever changed through the
+    // setters below, which keep the derived stats in sync.
+    unsigned strength = 0;
+    unsigned agility = 0;
+    unsigned bonusAttackPower = 0;
+    bool berserkerStance = true;
+
+    // Attempts left until each proc next fires, 0 if it never does
+    uint32_t procCountdowns[NumProcs] = { 0 };
+
+    // Auras, as one array per field indexed by AuraKind. An aura's entries
+    // only mean something while its bit in activeAuras is set.
+    uint32_t activeAuras = 0;
+    // Time of the next tick or the expiry, DBL_MAX if neither
+    double auraTimes[NumAuras];
+    unsigned auraTicks[NumAuras] = { 0 };
+    unsigned auraCharges[NumAuras] = { 0 };
+    // The aura the Aura event is for
+    AuraKind nextAura = AuraKind(0);
+
+    // Targets with each debuff. The per-target fields are in the cold
+    // state, as one array per field indexed by target, and only mean
+    // something while the target's bit in the debuff's mask is set, so the
+    // cost of a debuff follows the targets that have it, not numTargets.
+    // Deep wounds ticks of all the targets share the DeepWounds event.
+    uint32_t deepWoundsTargets = 0;
+    // Targets that dodged within the overpower proc duration.
+    // AU_OverpowerProc is up while any of them is.
+    uint32_t overpowerTargets = 0;
+
+    // Combined modifiers of the active auras, refreshed only when an aura
+    // with modifiers comes or goes
+    double auraDamageMul = 1.0;
+    double auraHasteMul = 1.0;
+    unsigned auraAttackPower = 0;
+
+    // Derived stats, refreshed when one of their inputs changes so that
+    // nothing is recomputed per swing
+    double attackPower = 0.0;
+    // Attack power contribution to weapon damage
+    double mainWeaponBonus = 0.0;
+    double offWeaponBonus = 0.0;
+    double specialWeaponBonus = 0.0;
+    // Current swing times, including flurry and haste
+    double mainSwingTime = 0.0;
+    double offSwingTime = 0.0;
+
+    Context ctx;
+
+    std::uniform_int_distribution<unsigned> mainWeaponDamageDist;
+    std::uniform_int_distribution<unsigned> offWeaponDamageDist;
+
+    // Cold state //////////////////////////////////////////////////////////////
+    const Config &cfg;
+
+    // Per-target debuff fields, see deepWoundsTargets. Time of the next deep
+    // wounds tick, DBL_MAX if none, and the tick damage, snapshotted when
+    // applied.
+    double deepWoundsTimes[MaxTargets];
+    unsigned deepWoundsTicks[MaxTargets] = { 0 };
+    double deepWoundsTickDamage[MaxTargets] = { 0.0 };
+    // When each target's overpower proc expires
+    double overpowerExpiry[MaxTargets] = { 0.0 };
+
+    // Written a hit at a time, read a block at a time
+    HitBuffer hits;
+
+    FightStats stats;
+    // Only allocated when recordHistograms
+    std::unique_ptr<FightHistograms> histograms;
+
+    // Fights are heap allocated by the replica jobs, keep them aligned.
+    // Freed fights are kept per thread for the next ones, whose memory is
+    // then already mapped and likely still in cache.
+    struct FreeList {
+        std::vector<void *> blocks;
+        ~FreeList() {
+            for (void *block : blocks) {
+                ::free(block);
+            }
+        }
+    };
+    static const size_t maxFreeFights = 64;
+    static FreeList &getFreeList() {
+        static thread_local FreeList list;
+        return list;
+    }
+    static void *operator new(size_t size) {
+        assert(size == sizeof(DPS));
+        FreeList &list = getFreeList();
+        if (!list.blocks.empty()) {
+            void *ptr = list.blocks.back();
+            list.blocks.pop_back();
+            return ptr;
+        }
+        void *ptr = nullptr;
+        if (::posix_memalign(&ptr, alignof(DPS), size) != 0)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    static void operator delete(void *ptr) {
+        FreeList &list = getFreeList();
+        if (list.blocks.size() < maxFreeFights) {
+            list.blocks.push_back(ptr);
+            return;
+        }
+        ::free(ptr);
+    }
+
+    DPS(const Config &config, unsigned seed, unsigned configId,
+        unsigned replica, bool antithetic = false) :
+        ctx(seed, configId, replica, antithetic),
+        mainWeaponDamageDist(config.p.mainWeaponDamageMin, config.p.mainWeaponDamageMax),
+        offWeaponDamageDist(config.p.offWeaponDamageMin, config.p.offWeaponDamageMax),
+        cfg(config) {
+
+        for (double &event : events) {
+            event = DBL_MAX;
+        }
+        for (double &time : auraTimes) {
+            time = DBL_MAX;
+        }
+        for (double &time : deepWoundsTimes) {
+            time = DBL_MAX;
+        }
+        stats.numTargets = cfg.p.numTargets;
+        if (recordHistograms) {
+            histograms.reset(new FightHistograms);
+        }
+
+        setStrength(cfg.p.strength);
+        setAgility(cfg.p.agility);
+        setBonusAttackPower(cfg.p.bonusAttackPower);
+        updateSwingTimes();
+
+        events[EK_MainSwing] = 0.0;
+        if (cfg.p.dualWield) {
+            events[EK_OffSwing] = 0.0;
+        }
+        if (cfg.p.angerManagementLevel) {
+            events[EK_AngerManagement] = 0.0;
+        }
+        events[EK_BloodrageCD] = 0.0;
+
+        for (size_t i = 0; i < NumProcs; ++i) {
+            if (cfg.procChances[i] > 0.0) {
+                procCountdowns[i] = drawProcCountdown(ProcKind(i));
+            }
+        }
+    }
+
+    double getTotalDamage() const {
+        static_assert(HitBuffer::Lanes == 4, "Add up every lane");
+        assert(hits.count == 0);
+        return (damageLanes[0] + damageLanes[1]) + (damageLanes[2] + damageLanes[3]);
+    }
+
+    bool isActive(EventKind ek) const {
+        return events[ek] != DBL_MAX;
+    }
+    void clear(EventKind ek) {
+        events[ek] = DBL_MAX;
+    }
+
+    void wakeRotation() {
+        rotationDirty = true;
+    }
+
+    // Auras ///////////////////////////////////////////////////////////////////
+    bool isAuraActive(AuraKind au) const {
+        return activeAuras & getAuraBit(au);
+    }
+    // Apply an aura, or restart it if it's already up
+    void gainAura(AuraKind au) {
+        const AuraInfo &info = cfg.auras[au];
+        if (info.period) {
+            auraTicks[au] = info.numTicks;
+            auraTimes[au] = curTime + info.period;
+        } else if (info.duration) {
+            auraTimes[au] = curTime + info.duration;
+        }
+        auraCharges[au] = info.charges;
+        if (!isAuraActive(au)) {
+            activeAuras |= getAuraBit(au);
+            if (cfg.modifierAuras & getAuraBit(au)) {
+                updateAuraModifiers();
+            }
+        }
+        scheduleAuras();
+        onAuraGained(au);
+    }
+    void loseAura(AuraKind au, bool expired = false) {
+        assert(isAuraActive(au));
+        activeAuras &= ~getAuraBit(au);
+        auraTimes[au] = DBL_MAX;
+        if (cfg.modifierAuras & getAuraBit(au)) {
+            updateAuraModifiers();
+        }
+        scheduleAuras();
+        onAuraLost(au, expired);
+    }
+    void useAuraCharge(AuraKind au) {
+        if (isAuraActive(au) && --auraCharges[au] == 0) {
+            loseAura(au);
+        }
+    }
+    // Handle the tick or expiry the Aura event is for
+    void updateAura(AuraKind au) {
+        const AuraInfo &info = cfg.auras[au];
+        if (!info.period) {
+            trace("    %s expires\n", getAuraName(au));
+            loseAura(au, /*expired=*/true);
+            return;
+        }
+        trace("    %s tick\n", getAuraName(au));
+        if (--auraTicks[au]) {
+            auraTimes[au] += info.period;
+            scheduleAuras();
+        } else {
+            loseAura(au, /*expired=*/true);
+        }
+        if (info.tickRage) {
+            gainRage(info.tickRage);
+        }
+    }
+    void scheduleAuras() {
+        double next = DBL_MAX;
+        for (uint32_t mask = activeAuras; mask; mask &= mask - 1) {
+            AuraKind au = AuraKind(__builtin_ctz(mask));
+            if (auraTimes[au] < next) {
+                next = auraTimes[au];
+                nextAura = au;
+            }
+        }
+        events[EK_Aura] = next;
+    }
+    void updateAuraModifiers() {
+        double damageMul = 1.0;
+        double hasteMul = 1.0;
+        unsigned attackPowerBonus = 0;
+        for (uint32_t mask = activeAuras & cfg.modifierAuras; mask; mask &= mask - 1) {
+            const AuraInfo &info = cfg.auras[__builtin_ctz(mask)];
+            damageMul *= info.damageMul;
+            hasteMul *= info.hasteMul;
+            attackPowerBonus += info.attackPower;
+        }
+        auraDamageMul = damageMul;
+        if (hasteMul != auraHasteMul) {
+            auraHasteMul = hasteMul;
+            updateSwingTimes();
+        }
+        if (attackPowerBonus != auraAttackPower) {
+            auraAttackPower = attackPowerBonus;
+            updateAttackPower();
+        }
+    }
+    // What particular auras do beyond their table entry
+    void onAuraGained(AuraKind au) {
+        switch (au) {
+        case AU_OverpowerProc:
+            wakeRotation();
+            scheduleCooldownReady();
+            break;
+        default:
+            break;
+        }
+    }
+    void onAuraLost(AuraKind au, bool expired) {
+        switch (au) {
+        case AU_OverpowerProc:
+            overpowerTargets = 0;
+            scheduleCooldownReady();
+            if (expired && !berserkerStance) {
+                trySwapStance();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    bool isReady(CooldownKind cd) const {
+        return readyMask & getCooldownBit(cd);
+    }
+    bool areReady(unsigned mask) const {
+        return (readyMask & mask) == mask;
+    }
+    void startCooldown(CooldownKind cd, double duration) {
+        assert(isReady(cd));
+        readyAt[cd] = curTime + duration;
+        readyMask &= ~getCooldownBit(cd);
+        nextReadyAt = std::min(nextReadyAt, readyAt[cd]);
+        scheduleCooldownReady();
+    }
+    // Mark every cooldown that has run out as ready
+    void updateCooldowns() {
+        nextReadyAt = DBL_MAX;
+        for (size_t i = 0; i < NumCooldowns; ++i) {
+            if (isReady(CooldownKind(i)))
+                continue;
+            if (readyAt[i] <= curTime) {
+                trace("    %s ready\n", getCooldownName(CooldownKind(i)));
+                readyMask |= getCooldownBit(CooldownKind(i));
+                wakeRotation();
+            } else {
+                nextReadyAt = std::min(nextReadyAt, readyAt[i]);
+            }
+        }
+        scheduleCooldownReady();
+    }
+    // Cooldowns of the abilities that the current stance and procs allow.
+    // Whenever either changes the wake up is rescheduled.
+    unsigned getWakeCooldowns() const {
+        unsigned mask = cfg.rotationCooldowns;
+        if (!berserkerStance) {
+            mask &= ~(getCooldownBit(CD_Whirlwind) | getCooldownBit(CD_BerserkerRage));
+        }
+        if (!isAuraActive(AU_OverpowerProc)) {
+            mask &= ~getCooldownBit(CD_Overpower);
+        }
+        return mask;
+    }
+    // Wake the rotation at the earliest time one of those abilities has
+    // both its own cooldown and the global cooldown ready. Abilities usable
+    // right now are already evaluated after every event. Cooldowns running
+    // out at any other time are only noticed by the next event.
+    void scheduleCooldownReady() {
+        const unsigned wakeMask = getWakeCooldowns();
+        double gcdReadyAt = isReady(CD_Global) ? curTime : readyAt[CD_Global];
+        double next = DBL_MAX;
+        for (size_t i = 0; i < NumCooldowns; ++i) {
+            CooldownKind cd = CooldownKind(i);
+            if (!(wakeMask & getCooldownBit(cd)))
+                continue;
+            double cdReadyAt = isReady(cd) ? curTime : readyAt[cd];
+            double usableAt = std::max(cdReadyAt, gcdReadyAt);
+            if (usableAt > curTime) {
+                next = std::min(next, usableAt);
+            }
+        }
+        events[EK_CooldownReady] = next;
+    }
+
+    void swapStance() {
+        trace("    %s stance\n", (berserkerStance ? "Battle" : "Berserker"));
+        assert(!isActive(EK_StanceCD));
+        events[EK_StanceCD] = curTime + cfg.p.stanceCDDuration;
+        setStance(!berserkerStance);
+        if (rage > cfg.stanceSwapMaxRage) {
+            auto waste = rage - cfg.stanceSwapMaxRage;
+            if (recordTotals) {
+                stats.wastedRageStanceSwap += waste;
+            }
+            trace("    stance swap wasted %u rage\n", waste);
+            recordRageTime();
+            rage = cfg.stanceSwapMaxRage;
+        }
+    }
+    void trySwapStance() {
+        if (!isActive(EK_StanceCD)) {
+            swapStance();
+        }
+    }
+    // Swap back now, or hold battle stance for a while. The StanceCD event
+    // swaps back at the end of the hold unless there's an overpower to use.
+    void swapBackAfterOverpower() {
+        if (cfg.p.overpowerStanceHold <= 0.0) {
+            trySwapStance();
+            return;
+        }
+        double holdEnd = curTime + cfg.p.overpowerStanceHold;
+        if (!isActive(EK_StanceCD) || events[EK_StanceCD] < holdEnd) {
+            events[EK_StanceCD] = holdEnd;
+        }
+    }
+
+    void addDamage(DamageSource source, unsigned target, double raw, double mul) {
+        trace("    %.2f damage\n", HitBuffer::getDamage(raw, mul));
+        if (hits.count == HitBuffer::Size) {
+            flushHits();
+        }
+        size_t i = hits.count++;
+        hits.raw[i] = raw;
+        hits.mul[i] = mul;
+        hits.source[i] = uint8_t(source);
+        hits.target[i] = uint8_t(target);
+    }
+    void flushHits() {
+        const size_t n = hits.count;
+        const size_t lanes = HitBuffer::Lanes;
+        double damage[HitBuffer::Size];
+        for (size_t i = 0; i < n; ++i) {
+            damage[i] = HitBuffer::getDamage(hits.raw[i], hits.mul[i]);
+        }
+        // Rotated so that sums[j] takes the hits i with i % lanes == j
+        double sums[lanes];
+        for (size_t j = 0; j < lanes; ++j) {
+            sums[j] = damageLanes[(nextLane + j) % lanes];
+        }
+        size_t i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            for (size_t j = 0; j < lanes; ++j) {
+                sums[j] += damage[i + j];
+            }
+        }
+        for (; i < n; ++i) {
+            sums[i % lanes] += damage[i];
+        }
+        for (size_t j = 0; j < lanes; ++j) {
+            damageLanes[(nextLane + j) % lanes] = sums[j];
+        }
+        nextLane = unsigned((nextLane + n) % lanes);
+        if (recordTotals) {
+            for (size_t i = 0; i < n; ++i) {
+                FightStats::DamageStat &stat = stats.damageStats[hits.source[i]];
+                stat.damage += damage[i];
+                stat.count += 1;
+                stats.targetDamage[hits.target[i]] += damage[i];
+            }
+        }
+        if (recordHistograms) {
+            for (size_t i = 0; i < n; ++i) {
+                histograms->damage[hits.source[i]].add(damage[i]);
+            }
+        }
+        hits.count = 0;
+    }
+
+    // Stat setters /////////////////////////////////////////////////////////////
+    void setStrength(unsigned val) {
+        strength = val;
+        updateAttackPower();
+    }
+    void setBonusAttackPower(unsigned val) {
+        bonusAttackPower = val;
+        updateAttackPower();
+    }
+    void setAgility(unsigned val) {
+        agility = val;
+        updateCritChance();
+    }
+    void setStance(bool berserker) {
+        berserkerStance = berserker;
+        updateCritChance();
+        wakeRotation();
+        scheduleCooldownReady();
+    }
+
+    // Derived stats ////////////////////////////////////////////////////////////
+    void updateAttackPower() {
+        attackPower = strength * 2 + cfg.battleShoutAttackPower + bonusAttackPower +
+                      auraAttackPower;
+        // TODO Should this be using base swing time or modified swing time? Surely base.
+        mainWeaponBonus = (attackPower / 14) * cfg.p.mainSwingTime;
+        offWeaponBonus = (attackPower / 14) * cfg.p.offSwingTime;
+        specialWeaponBonus = (attackPower / 14) * cfg.specialAttackWeaponSpeed;
+    }
+
+    // TODO add speed enchant as a param
+    void updateSwingTimes() {
+        double mul = auraHasteMul * cfg.hasteMul;
+        mainSwingTime = cfg.p.mainSwingTime / mul;
+        offSwingTime = cfg.p.offSwingTime / mul;
+    }
+
+    // Fold the rolls made with the current crit chances into the expected
+    // hit kind counts
+    void updateExpected() {
+        if (!recordTotals)
+            return;
+        for (size_t i = 0; i < NumAttackTables; ++i) {
+            AttackTableKind at = AttackTableKind(i);
+            stats.hitStats[at].updateExpected(cfg.tables[at], critThresholds[at]);
+        }
+    }
+
+    void updateCritChance() {
+        updateExpected();
+        for (size_t i = 0; i < NumAttackTables; ++i) {
+            AttackTableKind at = AttackTableKind(i);
+            critThresholds[at] = cfg.tables[at].getCritThreshold(
+                cfg.getCritChance(at, berserkerStance, agility));
+        }
+    }
+    double getAttackPower() const {
+        return attackPower;
+    }
+
+    HitKind roll(AttackTableKind at) {
+        HitKind hk = cfg.tables[at].roll(ctx.get(RandomStreamKind(at)),
+                                         critThresholds[at]);
+        if (recordTotals) {
+            ++stats.hitStats[at].counts[hk];
+        }
+        return hk;
+    }
+
+    // Target debuffs ///////////////////////////////////////////////////////////
+    // Apply deep wounds to a target, or restart it
+    void applyDeepWounds(unsigned target) {
+        if (cfg.p.deepWoundsLevel == 0)
+            return;
+        deepWoundsTargets |= getTargetBit(target);
+        deepWoundsTicks[target] = deepWoundsNumTicks;
+        deepWoundsTimes[target] = curTime + deepWoundsPeriod;
+        deepWoundsTickDamage[target] = getWeaponDamage(true, /*average=*/true) *
+                                       cfg.deepWoundsTickMul * auraDamageMul;
+        scheduleDeepWounds();
+    }
+    // Tick every target whose tick is due, which is all of them when they
+    // were applied by the same attack
+    void tickDeepWounds() {
+        for (uint32_t mask = deepWoundsTargets; mask; mask &= mask - 1) {
+            unsigned target = unsigned(__builtin_ctz(mask));
+            if (deepWoundsTimes[target] != curTime)
+                continue;
+            trace("    DeepWounds tick on target %u\n", target);
+            if (--deepWoundsTicks[target]) {
+                deepWoundsTimes[target] += deepWoundsPeriod;
+            } else {
+                deepWoundsTargets &= ~getTargetBit(target);
+                deepWoundsTimes[target] = DBL_MAX;
+            }
+            addDamage(DS_DeepWounds, target, deepWoundsTickDamage[target], 1.0);
+        }
+        scheduleDeepWounds();
+    }
+    void scheduleDeepWounds() {
+        double next = DBL_MAX;
+        for (uint32_t mask = deepWoundsTargets; mask; mask &= mask - 1) {
+            next = std::min(next, deepWoundsTimes[__builtin_ctz(mask)]);
+        }
+        events[EK_DeepWounds] = next;
+    }
+
+    void gainOverpowerProc(unsigned target) {
+        overpowerTargets |= getTargetBit(target);
+        overpowerExpiry[target] = curTime + cfg.auras[AU_OverpowerProc].duration;
+        // Restarting the aura makes it last as long as this latest proc
+        gainAura(AU_OverpowerProc);
+    }
+    // Take the first target whose proc is still up. The aura lasts until
+    // the latest of the others, or ends if there are none.
+    unsigned useOverpowerProc() {
+        assert(isAuraActive(AU_OverpowerProc));
+        unsigned target = MaxTargets;
+        double latest = -1.0;
+        for (uint32_t mask = overpowerTargets; mask; mask &= mask - 1) {
+            unsigned t = unsigned(__builtin_ctz(mask));
+            if (overpowerExpiry[t] < curTime) {
+                overpowerTargets &= ~getTargetBit(t);
+            } else if (target == MaxTargets) {
+                target = t;
+            } else {
+                latest = std::max(latest, overpowerExpiry[t]);
+            }
+        }
+        assert(target < MaxTargets);
+        overpowerTargets &= ~getTargetBit(target);
+        if (overpowerTargets) {
+            auraTimes[AU_OverpowerProc] = latest;
+            scheduleAuras();
+        } else {
+            loseAura(AU_OverpowerProc);
+        }
+        return target;
+    }
+    void applyFlurry() {
+        if (!cfg.p.flurryLevel)
+            return;
+        gainAura(AU_Flurry);
         // TODO Decide if this should update pending swings?
     }
+    // Fixed-chance procs draw the number of attempts until they next fire
+    // once, so an attempt is just a decrement and test. Procs whose chance
+    // changes during a fight should roll each attempt with ctx.chance().
+    bool rollProc(ProcKind pk) {
+        if (recordTotals) {
+            ++stats.procStats[pk].attempts;
+        }
+        uint32_t &countdown = procCountdowns[pk];
+        if (!countdown || --countdown)
+            return false;
+        countdown = drawProcCountdown(pk);
+        if (recordTotals) {
+            ++stats.procStats[pk].procs;
+        }
+        return true;
+    }
+    // A certain proc fires on every attempt, without a draw, as with
+    // ctx.chance(). Its log2(1 - chance) is -inf.
+    uint32_t drawProcCountdown(ProcKind pk) {
+        if (cfg.procChances[pk] >= 1.0)
+            return 1;
+        return ctx.geometric(getProcStream(pk), cfg.procLog2Miss[pk]);
+    }
     // FIXME Special attack sword spec procs should use getSpecialWeaponDamage.
     // Should they also apply other bonus damage e.g. mortal strike damage?
     void applySwordSpec() {
-        if (ctx.chance(swordSpecChance)) {
-            log("    Sword spec!\n");
+        if (rollProc(PK_SwordSpec)) {
+            trace("    Sword spec!\n");
             weaponSwing(DS_SwordSpec);
         }
     }
     void applyUnbridledWrath() {
-        if (ctx.chance(unbridledWrathChance)) {
-            log("    Unbridled wrath\n");
+        if (rollProc(PK_UnbridledWrath)) {
+            trace("    Unbridled wrath\n");
             gainRage(1);
         }
     }
@@ -532,98 +1658,94 @@ struct DPS {
     // Return weapon damage without any multipliers applied
     // TODO How does deep wounds work with offhand crits?
     double getWeaponDamage(bool main = true, bool average = false) {
-        // TODO Should this be using base swing time or modified swing time? Surely base.
         double base;
         if (average) {
-            auto min = main ? p.mainWeaponDamageMin : p.offWeaponDamageMin;
-            auto max = main ? p.mainWeaponDamageMax : p.offWeaponDamageMax;
-            base = min + double(max - min) / 2;
+            base = main ? cfg.mainWeaponDamageAvg : cfg.offWeaponDamageAvg;
         } else {
             auto &dist = main ? mainWeaponDamageDist : offWeaponDamageDist;
-            base = dist(ctx.rng);
+            base = dist(ctx.get(RS_WeaponDamage));
         }
-        auto swingTime = main ? p.mainSwingTime : p.offSwingTime;
-        return base + ((getAttackPower() / 14) * swingTime);
+        return base + (main ? mainWeaponBonus : offWeaponBonus);
     }
 
     double getSpecialWeaponDamage() {
-        double base = mainWeaponDamageDist(ctx.rng);
-        return base + ((getAttackPower() / 14) * specialAttackWeaponSpeed);
+        double base = mainWeaponDamageDist(ctx.get(RS_WeaponDamage));
+        return base + specialWeaponBonus;
     }
 
+    // Credit the time since the last change to the current rage level
+    void recordRageTime() {
+        if (!recordHistograms)
+            return;
+        histograms->rageTime.add(rage, curTime - rageSince);
+        rageSince = curTime;
+    }
     void gainRage(unsigned r) {
+        recordRageTime();
+        unsigned prevRage = rage;
         rage += r;
-        if (rage > 100) {
-            auto waste = rage - 100;
-            wastedRageSpillOver += waste;
-            log("    +%u rage, 100 total, %u wasted\n", r, waste);
-            rage = 100;
+        if (rage > maxRage) {
+            auto waste = rage - maxRage;
+            if (recordTotals) {
+                stats.wastedRageSpillOver += waste;
+            }
+            trace("    +%u rage, %u total, %u wasted\n", r, maxRage, waste);
+            rage = maxRage;
         } else {
-            log("    +%u rage, %u total\n", r, rage);
+            trace("    +%u rage, %u total\n", r, rage);
+        }
+        if (rage >= cfg.nextRageThreshold[prevRage]) {
+            wakeRotation();
         }
     }
     void spendRage(unsigned r) {
         assert(rage >= r);
-        spentRage += r;
+        recordRageTime();
+        if (recordTotals) {
+            stats.spentRage += r;
+        }
         rage -= r;
     }
 
     bool isMortalStrikeAvailable() const {
-        if (!p.mortalStrikeLevel)
+        if (!cfg.p.mortalStrikeLevel)
             return false;
         if (rage < mortalStrikeCost)
             return false;
-        if (isActive(EK_MortalStrikeCD))
-            return false;
-        if (isActive(EK_GlobalCD))
-            return false;
-        return true;
+        return areReady(getCooldownBit(CD_MortalStrike) | getCooldownBit(CD_Global));
     }
     bool isBerserkerRageAvailable() const {
-        if (!p.improvedBerserkerRageLevel)
+        if (!cfg.p.improvedBerserkerRageLevel)
             return false;
         if (!berserkerStance)
             return false;
-        if (isActive(EK_GlobalCD))
-            return false;
-        if (isActive(EK_BerserkerRageCD))
-            return false;
-        return true;
+        return areReady(getCooldownBit(CD_BerserkerRage) | getCooldownBit(CD_Global));
     }
     bool isDeathWishAvailable() const {
-        if (!p.deathWishLevel)
+        if (!cfg.p.deathWishLevel)
             return false;
         if (rage < deathWishCost)
             return false;
-        if (isActive(EK_GlobalCD))
-            return false;
-        if (isActive(EK_DeathWishCD))
-            return false;
-        return true;
+        return areReady(getCooldownBit(CD_DeathWish) | getCooldownBit(CD_Global));
     }
     bool isBloodthirstAvailable() const {
-        if (!p.bloodthirstLevel)
+        if (!cfg.p.bloodthirstLevel)
             return false;
         if (rage < bloodthirstCost)
             return false;
-        if (isActive(EK_BloodthirstCD))
-            return false;
-        if (isActive(EK_GlobalCD))
-            return false;
-        return true;
+        return areReady(getCooldownBit(CD_Bloodthirst) | getCooldownBit(CD_Global));
     }
     bool isWhirlwindAvailable() const {
         if (!berserkerStance)
             return false;
-        if (isActive(EK_WhirlwindCD))
+        if (!areReady(getCooldownBit(CD_Whirlwind) | getCooldownBit(CD_Global)))
             return false;
-        if (isActive(EK_GlobalCD))
-            return false;
-        if (rage >= 70)
-            return true;
         if (rage < whirlwindCost)
             return false;
-        if (isActive(EK_OverpowerProcExpire) && (rage > stanceSwapMaxRage + 10))
+        if (rage >= cfg.p.whirlwindMinRage)
+            return true;
+        if (isAuraActive(AU_OverpowerProc) &&
+            (rage > cfg.stanceSwapMaxRage + cfg.p.whirlwindOverpowerMargin))
             return true;
         return false;
     }
@@ -631,160 +1753,179 @@ struct DPS {
     bool isOverpowerAvailable() const {
         if (rage < overpowerCost)
             return false;
-        if (isActive(EK_OverpowerCD))
-            return false;
-        if (isActive(EK_GlobalCD))
+        if (!areReady(getCooldownBit(CD_Overpower) | getCooldownBit(CD_Global)))
             return false;
-        return isActive(EK_OverpowerProcExpire);
+        return isAuraActive(AU_OverpowerProc);
     }
 
     void triggerGlobalCD() {
-        assert(!isActive(EK_GlobalCD));
-        events[EK_GlobalCD] = curTime + globalCDDuration;
+        startCooldown(CD_Global, globalCDDuration);
     }
 
+    // One cost and global cooldown, then a roll and 'attack()' damage for
+    // each target in the mask
     // TODO work out how rage refund works for miss/dodge/parry
     template <class AttackCallback>
     void specialAttack(DamageSource ds, unsigned cost,
-                       const AttackTable &table,
+                       AttackTableKind table, uint32_t targets,
                        AttackCallback &&attack) {
+        if (recordHistograms) {
+            if (lastSpecialTime >= 0.0) {
+                histograms->specialIntervals.add(curTime - lastSpecialTime);
+            }
+            lastSpecialTime = curTime;
+        }
         spendRage(cost);
         triggerGlobalCD();
-        HitKind hk = table.roll(ctx);
-        log("    %s\n", getHitKindName(hk));
-        double mul = 0.0;
-        bool success = true;
-        switch (hk) {
-        case HK_Dodge:
-            events[EK_OverpowerProcExpire] = curTime + overpowerProcDuration;
-            // FALL THROUGH
-        case HK_Miss:
-        case HK_Parry:
-            success = false;
-            break;
-        case HK_Glance:
-            assert(0);
-            break;
-        case HK_Crit:
-            applyDeepWounds();
-            applyFlurry();
-            mul = specialCritMul;
-            break;
-        case HK_Hit:
-        case HK_Block:
-            mul = attackMul;
-            break;
-        }
-        if (success) {
-            mul *= isActive(EK_DeathWishExpire) ? 1.2 : 1.0;
-            addDamage(ds, attack() * mul);
+        for (; targets; targets &= targets - 1) {
+            unsigned target = unsigned(__builtin_ctz(targets));
+            HitKind hk = roll(table);
+            trace("    %s\n", getHitKindName(hk));
+            double mul = 0.0;
+            bool success = true;
+            switch (hk) {
+            case HK_Dodge:
+                gainOverpowerProc(target);
+                // FALL THROUGH
+            case HK_Miss:
+            case HK_Parry:
+                success = false;
+                break;
+            case HK_Glance:
+                assert(0);
+                break;
+            case HK_Crit:
+                applyDeepWounds(target);
+                applyFlurry();
+                mul = cfg.specialCritMul;
+                break;
+            case HK_Hit:
+            case HK_Block:
+                mul = cfg.attackMul;
+                break;
+            }
+            if (success) {
+                mul *= auraDamageMul;
+                addDamage(ds, target, attack(), mul);
+            }
+            applyUnbridledWrath();
         }
-        applyUnbridledWrath();
     }
 
-    void trySpecialAttack() {
-        if (isActive(EK_GlobalCD))
-            return;
+    // Returns whether an ability was used
+    bool trySpecialAttack() {
+        if (!isReady(CD_Global))
+            return false;
 
         if (isBerserkerRageAvailable()) {
-            log("    Berserker Rage\n");
-            gainRage(5 * p.improvedBerserkerRageLevel);
-            events[EK_BerserkerRageCD] = curTime + 30;
+            trace("    Berserker Rage\n");
+            gainRage(5 * cfg.p.improvedBerserkerRageLevel);
+            startCooldown(CD_BerserkerRage, 30);
             triggerGlobalCD();
         } else if (isDeathWishAvailable()) {
-            log("    Death Wish\n");
+            trace("    Death Wish\n");
             spendRage(deathWishCost);
-            events[EK_DeathWishExpire] = curTime + 30;
-            events[EK_DeathWishCD] = curTime + 180;
+            gainAura(AU_DeathWish);
+            startCooldown(CD_DeathWish, 180);
             triggerGlobalCD();
         } else if (isMortalStrikeAvailable()) {
-            log("    Mortal Strike\n");
-            events[EK_MortalStrikeCD] = curTime + 6;
-            specialAttack(DS_MortalStrike, mortalStrikeCost, specialTable,
-                          [this]() {
+            trace("    Mortal Strike\n");
+            startCooldown(CD_MortalStrike, 6);
+            specialAttack(DS_MortalStrike, mortalStrikeCost, AT_Special,
+                          getTargetBit(0), [this]() {
                 return getSpecialWeaponDamage() + 160;
             });
             applySwordSpec();
         } else if (isBloodthirstAvailable()) {
-            log("    Bloodthirst\n");
-            events[EK_BloodthirstCD] = curTime + 6;
-            specialAttack(DS_Bloodthirst, bloodthirstCost, specialTable,
-                          [this]() {
+            trace("    Bloodthirst\n");
+            startCooldown(CD_Bloodthirst, 6);
+            specialAttack(DS_Bloodthirst, bloodthirstCost, AT_Special,
+                          getTargetBit(0), [this]() {
                 return getAttackPower() * 0.45;
             });
         } else if (isWhirlwindAvailable()) {
-            log("    Whirlwind\n");
-            events[EK_WhirlwindCD] = curTime + 10;
-            specialAttack(DS_Whirlwind, whirlwindCost, specialTable,
-                          [this]() {
+            trace("    Whirlwind\n");
+            startCooldown(CD_Whirlwind, 10);
+            specialAttack(DS_Whirlwind, whirlwindCost, AT_Special,
+                          getTargetBit(cfg.whirlwindTargets) - 1, [this]() {
                 return getSpecialWeaponDamage();
             });
-            applySwordSpec();
+            // Each target hit is a chance of an extra swing, at the first
+            for (unsigned i = 0; i < cfg.whirlwindTargets; ++i) {
+                applySwordSpec();
+            }
         } else if (isOverpowerAvailable()) {
             if (berserkerStance) {
                 trySwapStance();
             }
             if (!berserkerStance && isOverpowerAvailable()) {
-                log("    Overpower\n");
-                events[EK_OverpowerCD] = curTime + 5;
-                clear(EK_OverpowerProcExpire);
-                specialAttack(DS_Overpower, overpowerCost, overpowerTable,
-                              [this]() {
+                trace("    Overpower\n");
+                startCooldown(CD_Overpower, 5);
+                unsigned target = useOverpowerProc();
+                specialAttack(DS_Overpower, overpowerCost, AT_Overpower,
+                              getTargetBit(target), [this]() {
                     return getSpecialWeaponDamage() + 35;
                 });
                 applySwordSpec();
-                trySwapStance();
+                swapBackAfterOverpower();
+            } else {
+                return false;
             }
+        } else {
+            return false;
         }
+        return true;
     }
 
     double getWeaponSwingRage(double damage) {
         return damage / 30.7;
     }
 
+    // At the first target
     void weaponSwing(DamageSource ds) {
-        HitKind hk = whiteTable.roll(ctx);
-        log("    %s\n", getHitKindName(hk));
+        HitKind hk = roll(AT_White);
+        trace("    %s\n", getHitKindName(hk));
         double mul = 0.0;
         bool success = true;
         switch (hk) {
         case HK_Dodge:
-            events[EK_OverpowerProcExpire] = curTime + overpowerProcDuration;
+            gainOverpowerProc(0);
             // FALL THROUGH
         case HK_Miss:
         case HK_Parry:
             success = false;
             break;
         case HK_Glance:
-            mul = glanceMul;
+            mul = cfg.glanceMul;
             break;
         case HK_Crit:
-            applyDeepWounds();
+            applyDeepWounds(0);
             applyFlurry();
-            mul = whiteCritMul;
+            mul = cfg.whiteCritMul;
             break;
         case HK_Hit:
         case HK_Block:
-            mul = attackMul;
+            mul = cfg.attackMul;
             break;
         }
         if (ds == DS_OffSwing) {
-            mul *= 0.5 * (1.0 + 0.05 * p.dualWieldSpecLevel);
+            mul *= 0.5 * (1.0 + 0.05 * cfg.p.dualWieldSpecLevel);
         }
-        mul *= isActive(EK_DeathWishExpire) ? 1.2 : 1.0;
+        mul *= auraDamageMul;
 
         // Set next swing time after (possibly) applying flurry
         {
             auto ek = (ds == DS_OffSwing) ? EK_OffSwing : EK_MainSwing;
-            auto swingTime = (ds == DS_OffSwing) ? getOffSwingTime() : getMainSwingTime();
+            auto swingTime = (ds == DS_OffSwing) ? offSwingTime : mainSwingTime;
             events[ek] = curTime + swingTime;
         }
 
         if (success) {
-            double damage = getWeaponDamage(ds != DS_OffSwing) * mul;
-            addDamage(ds, damage);
+            double raw = getWeaponDamage(ds != DS_OffSwing);
+            addDamage(ds, 0, raw, mul);
+            // Rage is the one thing that needs the damage straight away
             // TODO does sword spec generate rage?
-            gainRage(getWeaponSwingRage(damage));
+            gainRage(getWeaponSwingRage(HitBuffer::getDamage(raw, mul)));
         }
 
         // TODO can sword spec trigger sword spec?
@@ -792,29 +1933,17 @@ struct DPS {
         applyUnbridledWrath();
     }
 
-    void run(double duration);
+    // Simulate until the first event at or after 'endTime'. Running to a
+    // series of end times processes exactly the same events as running to
+    // the last one directly.
+    void runUntil(double endTime);
+    void run(double duration) {
+        runUntil(curTime + duration);
+    }
 };
 
-// TODO should this reset the tick time if it's already active?
-template <EventKind EK, unsigned NumTicks, unsigned Period>
-void Tick<EK, NumTicks, Period>::start(DPS &dps) {
-    ticks = NumTicks;
-    dps.events[EK] = dps.curTime + Period;
-}
-
-template <EventKind EK, unsigned NumTicks, unsigned Period>
-void Tick<EK, NumTicks, Period>::tick(DPS &dps) {
-    assert(ticks);
-    --ticks;
-    if (ticks) {
-        dps.events[EK] += Period;
-    } else {
-        dps.clear(EK);
-    }
-}
-
-void DPS::run(double duration) {
-    double endTime = curTime + duration;
+template <Instrumentation In>
+void DPS<In>::runUntil(double endTime) {
     while (curTime < endTime) {
         EventKind curEvent;
         {
@@ -830,68 +1959,71 @@ void DPS::run(double duration) {
             assert(lowTime >= curTime);
             curTime = lowTime;
         }
+        // Cooldowns running out at exactly this time are left to the
+        // CooldownReady event, which comes last
+        if (curTime > nextReadyAt) {
+            updateCooldowns();
+        }
 
-        log("%.4f %s\n", curTime, getEventName(curEvent));
+        if (recordTotals) {
+            ++stats.numEvents;
+        }
+        trace("%.4f %s\n", curTime, getEventName(curEvent));
 
         switch (curEvent) {
         case EK_MainSwing:
-            if (flurryCharges) {
-                --flurryCharges;
-            }
+            useAuraCharge(AU_Flurry);
             weaponSwing(DS_MainSwing);
             break;
         case EK_OffSwing:
-            if (flurryCharges) {
-                --flurryCharges;
-            }
+            useAuraCharge(AU_Flurry);
             weaponSwing(DS_OffSwing);
             break;
         case EK_AngerManagement:
             events[curEvent] += 3;
             gainRage(1);
             break;
-        case EK_DeepWoundsTick:
-            deepWoundsTicks.tick(*this);
-            addDamage(DS_DeepWounds, deepWoundsTickDamage);
+        case EK_DeepWounds:
+            tickDeepWounds();
             break;
-        case EK_BloodrageTick:
-            bloodrageTicks.tick(*this);
-            gainRage(1);
+        case EK_Aura:
+            updateAura(nextAura);
             break;
-        case EK_MortalStrikeCD:
-        case EK_BloodthirstCD:
-        case EK_DeathWishCD:
-        case EK_WhirlwindCD:
-        case EK_OverpowerCD:
-        case EK_BerserkerRageCD:
-        case EK_GlobalCD:
-            clear(curEvent);
+        case EK_CooldownReady:
+            updateCooldowns();
             break;
         case EK_BloodrageCD:
             // Not on gcd
             events[curEvent] += 60;
             gainRage(10);
-            bloodrageTicks.start(*this);
-            break;
-        case EK_DeathWishExpire:
-            clear(curEvent);
-            break;
-        case EK_OverpowerProcExpire:
-            clear(curEvent);
-            if (!berserkerStance) {
-                trySwapStance();
-            }
+            gainAura(AU_Bloodrage);
             break;
         case EK_StanceCD:
             clear(curEvent);
-            if (!berserkerStance && !isActive(EK_OverpowerProcExpire)) {
+            // Lets the rotation swap to battle stance for overpower
+            wakeRotation();
+            if (!berserkerStance && !isAuraActive(AU_OverpowerProc)) {
                 swapStance();
             }
             break;
         }
 
-        trySpecialAttack();
+        // Everything in the rotation is on the GCD, so a wake up during it
+        // is kept for when it ends
+        if (rotationDirty && isReady(CD_Global)) {
+            rotationDirty = false;
+            bool used = trySpecialAttack();
+            if (recordTotals) {
+                ++stats.numEvaluations;
+                stats.numIdleEvaluations += !used;
+            }
+        }
     }
+
+    flushHits();
+    updateExpected();
+    recordRageTime();
+    stats.duration = curTime;
 }
 
 bool parseVal(StrView str, double &out) {
@@ -977,6 +2109,74 @@ void parseParam(StrView str, bool &out, StrView param) {
     }
 }
 
+bool offsetVal(unsigned &val, double delta) {
+    double result = std::round(val + delta);
+    if (result < 0.0 || result > UINT_MAX)
+        return false;
+    val = unsigned(result);
+    return true;
+}
+bool offsetVal(double &val, double delta) {
+    if (val + delta < 0.0)
+        return false;
+    val += delta;
+    return true;
+}
+bool offsetVal(bool &, double) {
+    return false;
+}
+
+// Add 'delta' to a numeric param. Returns false, leaving the params as they
+// were, if there's no such param, it isn't numeric or the result would be
+// negative or out of the supported range. In the last case 'error', if
+// given, gets the reason.
+bool offsetParam(Params &params, StrView name, double delta,
+                 std::string *error = nullptr) {
+    Params result = params;
+    #define X(NAME, TYPE, VALUE)                                   \
+    if (name == #NAME) {                                           \
+        if (!offsetVal(result.NAME, delta))                        \
+            return false;                                          \
+        std::string resultError = result.getError();               \
+        if (!resultError.empty()) {                                \
+            if (error) {                                           \
+                *error = resultError;                              \
+            }                                                      \
+            return false;                                          \
+        }                                                          \
+        params = result;                                           \
+        return true;                                               \
+    }
+    PARAM_LIST
+    #undef X
+    return false;
+}
+
+// Set a param from its text form. False if there's no such param or the
+// value is invalid.
+bool setParam(Params &params, StrView name, StrView valStr) {
+    #define X(NAME, TYPE, VALUE)                    \
+    if (name == #NAME) {                            \
+        return parseVal(valStr, params.NAME);       \
+    }
+    PARAM_LIST
+    #undef X
+    return false;
+}
+
+// Keys that tell params apart exactly, one field per call
+void appendKey(std::string &key, double val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%a,", val);
+    key += buf;
+}
+void appendKey(std::string &key, unsigned val) {
+    key += std::to_string(val) + ",";
+}
+void appendKey(std::string &key, bool val) {
+    key += val ? "1," : "0,";
+}
+
 void parseParamArg(Params &params, StrView str) {
     auto eq = str.find('=');
     if (eq == StrView::npos) {
@@ -1079,89 +2279,3240 @@ struct ArgParser {
     }
 };
 
-enum ResultKind {
-    RK_dps,
-};
-void emitResult(ResultKind rk, const DPS &dps) {
-    switch (rk) {
-    case RK_dps:
-        printf("%.2f\n", dps.getTotalDamage() / dps.curTime);
-        return;
+template <Instrumentation In>
+void logSummary(const DPS<In> &dps) {
+    auto totalDamage = dps.getTotalDamage();
+    log("Damage: %.2f\n", totalDamage);
+    for (unsigned i = 0; i < NumDamageSources; ++i) {
+        DamageSource ds = DamageSource(i);
+        const FightStats::DamageStat &stat = dps.stats.damageStats[i];
+        log("    %s: %u events, %.2f damage, %.2f%%\n",
+            getDamageSourceName(ds), stat.count, stat.damage,
+            stat.damage * 100 / totalDamage);
+    }
+    if (dps.stats.numTargets > 1) {
+        for (unsigned i = 0; i < dps.stats.numTargets; ++i) {
+            log("    Target %u: %.2f damage, %.2f%%\n", i, dps.stats.targetDamage[i],
+                dps.stats.targetDamage[i] * 100 / totalDamage);
+        }
+    }
+
+    log("Total wasted rage due to spill-over: %u\n", dps.stats.wastedRageSpillOver);
+    log("Total wasted rage due to stance swap: %u\n", dps.stats.wastedRageStanceSwap);
+    log("Total spent rage: %u\n", dps.stats.spentRage);
+
+    if (logFile) {
+        for (size_t i = 0; i < NumAttackTables; ++i) {
+            log("%s hit table ", getAttackTableName(AttackTableKind(i)));
+            dps.stats.hitStats[i].print(logFile);
+        }
     }
-    assert(0);
 }
 
-int main(int argc, char **argv) {
-    Params params;
-    unsigned durationHours = 100;
+// Replicas ////////////////////////////////////////////////////////////////////
 
-    bool haveSeed = false;
+// Observed minus expected hit table and proc frequencies, per second of
+// simulated time. Each has expectation zero, and they explain much of the
+// difference in damage between replicas.
+const size_t NumControlVariates = 3 * NumAttackTables + NumProcs;
+
+template <Instrumentation In>
+std::vector<double> getControlVariates(const DPS<In> &dps) {
+    std::vector<double> result;
+    for (const HitStats &hitStats : dps.stats.hitStats) {
+        result.push_back(hitStats.getDeviation(HK_Miss) +
+                         hitStats.getDeviation(HK_Dodge) +
+                         hitStats.getDeviation(HK_Parry));
+        result.push_back(hitStats.getDeviation(HK_Glance));
+        result.push_back(hitStats.getDeviation(HK_Crit));
+    }
+    for (size_t i = 0; i < NumProcs; ++i) {
+        result.push_back(dps.stats.procStats[i].getDeviation(dps.cfg.procChances[i]));
+    }
+    for (double &val : result) {
+        val /= dps.curTime;
+    }
+    return result;
+}
+
+struct ReplicaResult {
+    double dps = 0.0;
+    std::vector<double> controls;
+
+    // Exact (hex float) text form, so shards can be merged without
+    // changing a single bit of the estimate
+    void print(FILE *file, unsigned idx) const {
+        fprintf(file, "%u %a", idx, dps);
+        for (double c : controls) {
+            fprintf(file, " %a", c);
+        }
+        fprintf(file, "\n");
+    }
+    bool parse(const char *line, unsigned &idx) {
+        char *end = nullptr;
+        unsigned long tmp = strtoul(line, &end, 10);
+        if (end == line || tmp != unsigned(tmp))
+            return false;
+        idx = unsigned(tmp);
+        line = end;
+        dps = strtod(line, &end);
+        if (end == line)
+            return false;
+        controls.clear();
+        for (;;) {
+            line = end;
+            double c = strtod(line, &end);
+            if (end == line)
+                break;
+            controls.push_back(c);
+        }
+        return true;
+    }
+};
+
+// The run a --result=replicas file belongs to. Shards can only be merged
+// into the same estimate as a single process run when all of this agrees,
+// and together they have every replica.
+struct ReplicaRun {
     unsigned seed = 0;
+    // Of the whole run, not of the shard
+    unsigned numReplicas = 0;
+    // The params, duration and antithetic flag
+    std::string key;
 
-    bool haveLog = false;
-    StrView logFilename;
+    ReplicaRun() { }
+    ReplicaRun(const Params &params, unsigned seed, unsigned numReplicas,
+               unsigned durationHours, bool antithetic) :
+        seed(seed), numReplicas(numReplicas) {
+        #define X(NAME, TYPE, VALUE) appendKey(key, params.NAME);
+        PARAM_LIST
+        #undef X
+        appendKey(key, durationHours);
+        appendKey(key, antithetic);
+    }
 
-    ResultKind resultKind = RK_dps;
+    bool operator==(const ReplicaRun &other) const {
+        return seed == other.seed && numReplicas == other.numReplicas &&
+               key == other.key;
+    }
+    bool operator!=(const ReplicaRun &other) const {
+        return !(*this == other);
+    }
 
-    ArgParser argParser(argv + 1, argc - 1);
-    while (!argParser.finished()) {
-        if (argParser.consume('v', "verbose")) {
-            verbose = true;
-        } else if (argParser.consume("duration", durationHours)) {
-            // Pass
-        } else if (argParser.consume("seed", seed)) {
-            haveSeed = true;
-        } else if (argParser.consume("log", logFilename)) {
-            haveLog = true;
-        } else if (argParser.peek().startswith("-")) {
-            fatal() << "Invalid argument '" << argParser.peek() << "'\n";
+    // 'SEED REPLICAS KEY', the key having no spaces
+    std::string str() const {
+        return std::to_string(seed) + " " + std::to_string(numReplicas) + " " + key;
+    }
+    bool parse(const char *str) {
+        char *end = nullptr;
+        unsigned long tmp = strtoul(str, &end, 10);
+        if (end == str || tmp != unsigned(tmp))
+            return false;
+        seed = unsigned(tmp);
+        str = end;
+        tmp = strtoul(str, &end, 10);
+        if (end == str || tmp != unsigned(tmp) || *end != ' ')
+            return false;
+        numReplicas = unsigned(tmp);
+        key = end + 1;
+        while (!key.empty() && isspace((unsigned char)key.back())) {
+            key.pop_back();
+        }
+        return !key.empty() && key.find(' ') == std::string::npos;
+    }
+};
+
+// Simulated time covered by one chunk of work on the thread pool. Short
+// replicas are grouped into a chunk, long ones are split into slices.
+const double chunkDuration = 60 * 60;
+
+// Set by --progress
+Telemetry *telemetry = nullptr;
+
+// All the replicas of one configuration. Fights are advanced chunk by chunk
+// on the thread pool. Each replica's result lands in its own slot, so the
+// reduction takes no locks and doesn't depend on how the work was split.
+// The fights themselves are in the subclass for the instrumentation level.
+struct SimJob {
+    const Config &config;
+    const unsigned seed;
+    const unsigned configId;
+    // Index of the first replica, when only part of the replicas of a
+    // configuration run in this process
+    const unsigned firstReplica;
+    const unsigned numReplicas;
+    const bool antithetic;
+    const double replicaDuration;
+
+    std::vector<ReplicaResult> results;
+    // Each replica's statistics, kept for the detailed result kinds
+    std::vector<FightStats> stats;
+    // Each replica's histograms, for the Full and Trace levels only
+    std::vector<std::unique_ptr<FightHistograms>> histograms;
+
+    std::atomic<size_t> numEvents{0};
+    std::atomic<size_t> numEvaluations{0};
+    std::atomic<size_t> numIdleEvaluations{0};
+    std::atomic<uint64_t> numDraws{0};
+    std::atomic<unsigned> remaining;
+
+    // Called on the worker that finishes the last replica. The job may be
+    // destroyed from here.
+    std::function<void()> onDone;
+    // Called on the worker that finishes each replica, with its index in
+    // the job, possibly on several workers at once
+    std::function<void(unsigned)> onReplica;
+
+    SimJob(const Config &config, unsigned seed, unsigned configId,
+           unsigned firstReplica, unsigned numReplicas,
+           bool antithetic, double replicaDuration) :
+        config(config), seed(seed), configId(configId),
+        firstReplica(firstReplica), numReplicas(numReplicas),
+        antithetic(antithetic), replicaDuration(replicaDuration),
+        results(numReplicas), stats(numReplicas), histograms(numReplicas),
+        remaining(numReplicas) { }
+    virtual ~SimJob() { }
+
+    static SimJob *create(Instrumentation in, const Config &config,
+                          unsigned seed, unsigned configId,
+                          unsigned firstReplica, unsigned numReplicas,
+                          bool antithetic, double replicaDuration);
+
+    bool isDone() const { return remaining.load() == 0; }
+
+    // Summed in replica order, so the totals don't depend on the threads
+    FightStats getTotals() const {
+        FightStats totals;
+        for (const FightStats &replicaStats : stats) {
+            totals.add(replicaStats);
+        }
+        return totals;
+    }
+    FightHistograms getHistograms() const {
+        FightHistograms totals;
+        for (const std::unique_ptr<FightHistograms> &replicaHistograms : histograms) {
+            if (replicaHistograms) {
+                totals.merge(*replicaHistograms);
+            }
+        }
+        return totals;
+    }
+
+    virtual size_t getFightSize() const = 0;
+    virtual void submit(ThreadPool &pool) = 0;
+};
+
+template <Instrumentation In>
+struct InstrumentedSimJob : SimJob {
+    std::vector<std::unique_ptr<DPS<In>>> fights;
+
+    InstrumentedSimJob(const Config &config, unsigned seed, unsigned configId,
+                       unsigned firstReplica, unsigned numReplicas,
+                       bool antithetic, double replicaDuration) :
+        SimJob(config, seed, configId, firstReplica, numReplicas,
+               antithetic, replicaDuration),
+        fights(numReplicas) { }
+
+    void runChunk(ThreadPool &pool, size_t worker,
+                  unsigned first, unsigned last, unsigned slice);
+
+    size_t getFightSize() const override {
+        return sizeof(DPS<In>);
+    }
+    void submit(ThreadPool &pool) override;
+};
+
+SimJob *SimJob::create(Instrumentation in, const Config &config,
+                       unsigned seed, unsigned configId,
+                       unsigned firstReplica, unsigned numReplicas,
+                       bool antithetic, double replicaDuration) {
+    switch (in) {
+        #define X(NAME)                                                        \
+        case IN_##NAME:                                                        \
+            return new InstrumentedSimJob<IN_##NAME>(                          \
+                config, seed, configId, firstReplica, numReplicas,             \
+                antithetic, replicaDuration);
+        INSTRUMENTATION_LIST
+        #undef X
+    }
+    assert(0);
+    return nullptr;
+}
+
+template <Instrumentation In>
+void InstrumentedSimJob<In>::runChunk(ThreadPool &pool, size_t worker,
+                                      unsigned first, unsigned last,
+                                      unsigned slice) {
+    double endTime = std::min((slice + 1) * chunkDuration, replicaDuration);
+    size_t chunkEvents = 0;
+    size_t chunkEvaluations = 0;
+    size_t chunkIdleEvaluations = 0;
+    for (unsigned i = first; i < last; ++i) {
+        std::unique_ptr<DPS<In>> &dps = fights[i];
+        if (!dps) {
+            unsigned replica = firstReplica + i;
+            unsigned idx = antithetic ? replica / 2 : replica;
+            bool mirrored = antithetic && (replica % 2);
+            dps.reset(new DPS<In>(config, seed, configId, idx, mirrored));
+        }
+        const FightStats &fightStats = dps->stats;
+        size_t prevEvents = fightStats.numEvents;
+        size_t prevEvaluations = fightStats.numEvaluations;
+        size_t prevIdleEvaluations = fightStats.numIdleEvaluations;
+        dps->runUntil(endTime);
+        chunkEvents += fightStats.numEvents - prevEvents;
+        chunkEvaluations += fightStats.numEvaluations - prevEvaluations;
+        chunkIdleEvaluations += fightStats.numIdleEvaluations - prevIdleEvaluations;
+    }
+    numEvents.fetch_add(chunkEvents, std::memory_order_relaxed);
+    numEvaluations.fetch_add(chunkEvaluations, std::memory_order_relaxed);
+    numIdleEvaluations.fetch_add(chunkIdleEvaluations, std::memory_order_relaxed);
+    if (telemetry) {
+        telemetry->addChunk(worker, chunkEvents,
+                            (endTime - slice * chunkDuration) * (last - first));
+    }
+
+    if (endTime < replicaDuration) {
+        pool.submit(worker, [this, &pool, first, last, slice](size_t w) {
+            runChunk(pool, w, first, last, slice + 1);
+        });
+        return;
+    }
+
+    uint64_t chunkDraws = 0;
+    for (unsigned i = first; i < last; ++i) {
+        DPS<In> &dps = *fights[i];
+        if (In >= IN_Trace) {
+            if (numReplicas > 1) {
+                log("Replica %u\n", firstReplica + i);
+            }
+            logSummary(dps);
+        }
+        results[i].dps = dps.getTotalDamage() / dps.curTime;
+        if (In >= IN_Totals) {
+            results[i].controls = getControlVariates(dps);
+            stats[i] = dps.stats;
+            histograms[i] = std::move(dps.histograms);
         } else {
-            parseParamArg(params, argParser.consume());
+            stats[i].duration = dps.curTime;
+        }
+        chunkDraws += dps.ctx.getNumDraws();
+        fights[i].reset();
+        if (telemetry) {
+            telemetry->addReplica(worker, results[i].dps);
+        }
+        if (onReplica) {
+            onReplica(i);
+        }
+    }
+    numDraws.fetch_add(chunkDraws, std::memory_order_relaxed);
+    // Nothing may touch the job once the callback has started
+    std::function<void()> done;
+    if (remaining.fetch_sub(last - first) == last - first) {
+        done = std::move(onDone);
+        if (telemetry) {
+            telemetry->addJob(worker);
         }
     }
+    if (done) {
+        done();
+    }
+}
 
-    if (!haveSeed) {
-        seed = unsigned(std::chrono::system_clock::now().time_since_epoch().count());
+template <Instrumentation In>
+void InstrumentedSimJob<In>::submit(ThreadPool &pool) {
+    if (telemetry) {
+        telemetry->addWork(numReplicas * replicaDuration);
+    }
+    unsigned perChunk = 1;
+    if (replicaDuration < chunkDuration) {
+        perChunk = unsigned(chunkDuration / replicaDuration);
     }
+    // The last chunk to finish may destroy the job, possibly before this
+    // loop is done, so it mustn't read the job's members
+    const unsigned n = numReplicas;
+    for (unsigned first = 0; first < n; first += perChunk) {
+        unsigned last = std::min(first + perChunk, n);
+        pool.submit([this, &pool, first, last](size_t worker) {
+            runChunk(pool, worker, first, last, 0);
+        });
+    }
+}
 
-    if (haveLog) {
-        const char *str = logFilename.data();
-        assert(str[logFilename.size()] == '\0');
-        logFile = ::fopen(str, "w");
-    } else if (verbose) {
-        logFile = stderr;
+// Combine replicas into a single estimate. Antithetic replicas come in
+// adjacent pairs, and each pair is one sample.
+Estimate estimateDPS(const std::vector<ReplicaResult> &replicas,
+                     bool antithetic, bool controlVariates) {
+    std::vector<double> all;
+    for (const ReplicaResult &r : replicas) {
+        all.push_back(r.dps);
     }
+    double baselineVariance = getVariance(all) / all.size();
 
-    log("Seed: %u\n", seed);
-    if (logFile) {
-        params.print(logFile);
+    const size_t group = antithetic ? 2 : 1;
+    std::vector<double> y;
+    std::vector<std::vector<double>> x;
+    for (size_t i = 0; i + group <= replicas.size(); i += group) {
+        double sum = 0.0;
+        std::vector<double> controls(replicas[i].controls.size(), 0.0);
+        for (size_t j = i; j < i + group; ++j) {
+            sum += replicas[j].dps;
+            for (size_t k = 0; k < controls.size(); ++k) {
+                controls[k] += replicas[j].controls[k] / group;
+            }
+        }
+        y.push_back(sum / group);
+        if (controlVariates) {
+            x.push_back(std::move(controls));
+        }
     }
+    return estimateMean(y, x, baselineVariance);
+}
 
-    DPS dps(params, seed);
-    dps.run(durationHours * 60 * 60);
+////////////////////////////////////////////////////////////////////////////////
 
-    auto totalDamage = dps.getTotalDamage();
-    log("Damage: %lu\n", totalDamage);
-    for (unsigned i = 0; i < NumDamageSources; ++i) {
-        DamageSource ds = DamageSource(i);
-        const DPS::DamageStat &stat = dps.damageStats[i];
-        log("    %s: %u events, %lu damage, %.2f%%\n",
-            getDamageSourceName(ds), stat.count, stat.damage,
-            (double(stat.damage * 100) / totalDamage));
+#define RESULT_KIND_LIST                                                       \
+    X(dps)                                                                     \
+    X(estimate)                                                                \
+    X(replicas)                                                                \
+    X(json)                                                                    \
+    X(csv)                                                                     \
+    X(binary)
+
+enum ResultKind {
+    #define X(NAME) RK_##NAME,
+    RESULT_KIND_LIST
+    #undef X
+};
+
+bool parseVal(StrView str, ResultKind &out) {
+    #define X(NAME)        \
+    if (str == #NAME) {    \
+        out = RK_##NAME;   \
+        return true;       \
     }
+    RESULT_KIND_LIST
+    #undef X
+    return false;
+}
 
-    log("Total wasted rage due to spill-over: %u\n", dps.wastedRageSpillOver);
-    log("Total wasted rage due to stance swap: %u\n", dps.wastedRageStanceSwap);
-    log("Total spent rage: %u\n", dps.spentRage);
+// One axis of a sweep: 'NAME:STEP' varies param NAME in increments of STEP
+// from its base value, leaving the other params at their base values.
+struct SweepAxis {
+    StrView label;
+    StrView name;
+    double step = 1.0;
+};
 
-    if (logFile) {
-        log("White hit table ");
-        dps.whiteTable.printStats(logFile);
-        log("Special hit table ");
-        dps.specialTable.printStats(logFile);
-        log("Overpower hit table ");
-        dps.overpowerTable.printStats(logFile);
+// NAME:STEP, or NAME:STEP:LABEL to name the axis in the output instead of
+// NAME:STEP
+bool parseVal(StrView str, SweepAxis &out) {
+    auto colon = str.find(':');
+    if (colon == StrView::npos)
+        return false;
+    out.label = str;
+    out.name = str.substr(0, colon);
+    StrView stepStr = str.substr(colon + 1);
+    auto labelColon = stepStr.find(':');
+    if (labelColon != StrView::npos) {
+        out.label = stepStr.substr(labelColon + 1);
+        stepStr = stepStr.substr(0, labelColon);
+        if (out.label.empty())
+            return false;
+    }
+    if (!parseVal(stepStr, out.step))
+        return false;
+    Params test;
+    return offsetParam(test, out.name, 0.0);
+}
+
+// A 'I/N' shard of the replicas
+struct Shard {
+    unsigned idx = 0;
+    unsigned count = 1;
+};
+
+bool parseVal(StrView str, Shard &out) {
+    auto slash = str.find('/');
+    if (slash == StrView::npos)
+        return false;
+    std::string idxStr = str.substr(0, slash);
+    if (!parseVal(StrView(idxStr), out.idx) ||
+        !parseVal(str.substr(slash + 1), out.count))
+        return false;
+    return out.count != 0 && out.idx < out.count;
+}
+
+// Columns of the --columnar files of --result=replicas: the replica index,
+// its DPS and its control variates
+std::vector<std::pair<std::string, std::string>> getReplicaColumns() {
+    std::vector<std::pair<std::string, std::string>> columns = {
+        { "replica", "u4" },
+        { "dps", "f8" },
+    };
+    for (size_t i = 0; i < NumControlVariates; ++i) {
+        columns.emplace_back("control" + std::to_string(i), "f8");
+    }
+    return columns;
+}
+
+void writeReplica(ColumnarWriter &writer, unsigned row, unsigned idx,
+                  const ReplicaResult &result) {
+    bool ok = writer.set(row, 0, uint32_t(idx)) && writer.set(row, 1, result.dps);
+    for (size_t i = 0; i < result.controls.size() && i < NumControlVariates; ++i) {
+        ok = ok && writer.set(row, 2 + i, result.controls[i]);
+    }
+    if (!ok) {
+        fatal() << "Failed to write replica " << idx << " to the columnar file\n";
+    }
+}
+
+// Replica results gathered from the --merge files, by replica index
+struct MergedReplicas {
+    std::vector<ReplicaResult> results;
+    std::vector<bool> present;
+    // Of the first file, which the others must match
+    ReplicaRun run;
+    std::string runFilename;
+
+    void setRun(StrView filename, const ReplicaRun &fileRun) {
+        if (runFilename.empty()) {
+            run = fileRun;
+            runFilename = filename;
+        } else if (fileRun != run) {
+            fatal() << "'" << filename << "' is from a different run than '"
+                    << runFilename << "' (seed, replicas, duration or params)\n";
+        }
+    }
+
+    void add(StrView filename, unsigned idx, ReplicaResult &&result) {
+        if (idx >= results.size()) {
+            results.resize(idx + 1);
+            present.resize(idx + 1, false);
+        }
+        if (present[idx]) {
+            fatal() << "Replica " << idx << " appears twice, the second time in '"
+                    << filename << "'\n";
+        }
+        present[idx] = true;
+        results[idx] = std::move(result);
+    }
+
+    // Every replica of the run must be there, each with the same controls,
+    // or the estimate would be silently wrong
+    void check() const {
+        if (results.empty()) {
+            fatal() << "No replica results to merge\n";
+        }
+        if (results.size() > run.numReplicas) {
+            fatal() << "Replica " << results.size() - 1 << " is beyond the "
+                    << run.numReplicas << " replicas of the run\n";
+        }
+        if (results.size() < run.numReplicas) {
+            fatal() << "Replicas " << results.size() << " to " << run.numReplicas - 1
+                    << " are missing from the merged results\n";
+        }
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (!present[i]) {
+                fatal() << "Replica " << i << " is missing from the merged results\n";
+            }
+            if (results[i].controls.size() != results[0].controls.size()) {
+                fatal() << "Replica " << i << " has " << results[i].controls.size()
+                        << " controls, replica 0 has " << results[0].controls.size()
+                        << "\n";
+            }
+        }
+    }
+};
+
+void readColumnarReplicas(StrView filename, MergedReplicas &replicas) {
+    ColumnarReader reader;
+    int idxColumn = -1, dpsColumn = -1;
+    ReplicaRun run;
+    bool haveRun = false;
+    if (reader.load(filename)) {
+        idxColumn = reader.find("replica");
+        dpsColumn = reader.find("dps");
+        haveRun = run.parse(reader.getLabels().c_str());
+    }
+    if (idxColumn < 0 || dpsColumn < 0 || reader.isFloat(size_t(idxColumn)) ||
+        !reader.isFloat(size_t(dpsColumn)) || !haveRun) {
+        fatal() << "Invalid columnar replica results in '" << filename << "'\n";
+    }
+    replicas.setRun(filename, run);
+    std::vector<size_t> controlColumns;
+    for (int column; (column = reader.find(
+             ("control" + std::to_string(controlColumns.size())).c_str())) >= 0; ) {
+        controlColumns.push_back(size_t(column));
+    }
+    for (uint64_t row = 0; row < reader.getNumRows(); ++row) {
+        ReplicaResult result;
+        unsigned idx = reader.getUnsigned(size_t(idxColumn), row);
+        result.dps = reader.getFloat(size_t(dpsColumn), row);
+        // Rows are written as the replicas finish
+        if (std::isnan(result.dps)) {
+            fatal() << "Incomplete replica results in '" << filename << "'\n";
+        }
+        for (size_t column : controlColumns) {
+            result.controls.push_back(reader.getFloat(column, row));
+        }
+        replicas.add(filename, idx, std::move(result));
+    }
+}
+
+// Read replica results written by --result=replicas, as text, after a
+// '# run' line, or columnar, with the run in the labels
+void readReplicas(StrView filename, MergedReplicas &replicas) {
+    std::string name = filename;
+    if (ColumnarReader::isColumnar(name)) {
+        readColumnarReplicas(filename, replicas);
+        return;
+    }
+    FILE *file = ::fopen(name.c_str(), "r");
+    if (!file) {
+        fatal() << "Failed to open '" << filename << "'\n";
+    }
+    char line[4096];
+    bool haveRun = false;
+    while (::fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, "# run ", 6)) {
+            ReplicaRun run;
+            if (haveRun || !run.parse(line + 6)) {
+                fatal() << "Invalid run in '" << filename << "': " << line;
+            }
+            replicas.setRun(filename, run);
+            haveRun = true;
+            continue;
+        }
+        if (!haveRun) {
+            fatal() << "'" << filename << "' doesn't start with a '# run' line\n";
+        }
+        ReplicaResult result;
+        unsigned idx = 0;
+        if (!result.parse(line, idx)) {
+            fatal() << "Invalid replica result in '" << filename << "': " << line;
+        }
+        replicas.add(filename, idx, std::move(result));
+    }
+    ::fclose(file);
+}
+
+// Whether the result kind is built from the fights' statistics, which are
+// only available when simulating (not when merging replica results)
+bool needsFightStats(ResultKind rk) {
+    return rk == RK_json || rk == RK_csv || rk == RK_binary;
+}
+
+// The cheapest engine that records everything the run asks for
+Instrumentation getInstrumentation(ResultKind rk, bool controlVariates,
+                                   bool profile, bool histograms) {
+    if (logFile)
+        return IN_Trace;
+    if (histograms)
+        return IN_Full;
+    if (needsFightStats(rk) || rk == RK_replicas || controlVariates || profile)
+        return IN_Totals;
+    return IN_None;
+}
+
+double getPercent(size_t count, size_t total) {
+    return total ? double(count) * 100 / total : 0.0;
+}
+
+// The standard error and variance reduction need two samples. Without them
+// they're NaN, which JSON and most CSV readers don't accept, so it's
+// written as 'missing' instead.
+void printEstimateVal(FILE *file, double val, const char *missing) {
+    if (std::isfinite(val)) {
+        fprintf(file, "%.4f", val);
+    } else {
+        fprintf(file, "%s", missing);
+    }
+}
+
+void printJson(FILE *file, const Estimate &est, const FightStats &totals) {
+    const double totalDamage = totals.getTotalDamage();
+    fprintf(file, "{\n");
+    fprintf(file, "    \"dps\": %.4f,\n", est.mean);
+    fprintf(file, "    \"stdError\": ");
+    printEstimateVal(file, est.stdError, "null");
+    fprintf(file, ",\n");
+    fprintf(file, "    \"varianceReduction\": ");
+    printEstimateVal(file, est.varianceReduction, "null");
+    fprintf(file, ",\n");
+    fprintf(file, "    \"samples\": %zu,\n", est.samples);
+    fprintf(file, "    \"duration\": %.1f,\n", totals.duration);
+    fprintf(file, "    \"events\": %zu,\n", totals.numEvents);
+    fprintf(file, "    \"totalDamage\": %.2f,\n", totalDamage);
+    fprintf(file, "    \"damage\": {\n");
+    for (size_t i = 0; i < NumDamageSources; ++i) {
+        const FightStats::DamageStat &stat = totals.damageStats[i];
+        fprintf(file, "        \"%s\": { \"damage\": %.2f, \"count\": %u, "
+                "\"dps\": %.4f, \"percent\": %.4f }%s\n",
+                getDamageSourceName(DamageSource(i)), stat.damage, stat.count,
+                stat.damage / totals.duration,
+                totalDamage > 0.0 ? stat.damage * 100 / totalDamage : 0.0,
+                i + 1 < NumDamageSources ? "," : "");
+    }
+    fprintf(file, "    },\n");
+    fprintf(file, "    \"targets\": [\n");
+    for (unsigned i = 0; i < totals.numTargets; ++i) {
+        double damage = totals.targetDamage[i];
+        fprintf(file, "        { \"damage\": %.2f, \"dps\": %.4f, \"percent\": %.4f }%s\n",
+                damage, damage / totals.duration,
+                totalDamage > 0.0 ? damage * 100 / totalDamage : 0.0,
+                i + 1 < totals.numTargets ? "," : "");
+    }
+    fprintf(file, "    ],\n");
+    fprintf(file, "    \"rage\": { \"spent\": %u, \"wastedSpillOver\": %u, "
+            "\"wastedStanceSwap\": %u },\n",
+            totals.spentRage, totals.wastedRageSpillOver, totals.wastedRageStanceSwap);
+    fprintf(file, "    \"hitTables\": {\n");
+    for (size_t i = 0; i < NumAttackTables; ++i) {
+        const HitStats &hitStats = totals.hitStats[i];
+        size_t rolls = hitStats.getNumRolls();
+        fprintf(file, "        \"%s\": { \"rolls\": %zu",
+                getAttackTableName(AttackTableKind(i)), rolls);
+        for (size_t j = 0; j < NumHitKinds; ++j) {
+            fprintf(file, ", \"%s\": %.4f", getHitKindName(HitKind(j)),
+                    getPercent(hitStats.counts[j], rolls));
+        }
+        fprintf(file, " }%s\n", i + 1 < NumAttackTables ? "," : "");
+    }
+    fprintf(file, "    },\n");
+    fprintf(file, "    \"procs\": {\n");
+    for (size_t i = 0; i < NumProcs; ++i) {
+        const FightStats::ProcStat &stat = totals.procStats[i];
+        fprintf(file, "        \"%s\": { \"attempts\": %zu, \"procs\": %zu }%s\n",
+                getProcName(ProcKind(i)), stat.attempts, stat.procs,
+                i + 1 < NumProcs ? "," : "");
+    }
+    fprintf(file, "    }\n");
+    fprintf(file, "}\n");
+}
+
+// A header line and a single row
+void printCsv(FILE *file, const Estimate &est, const FightStats &totals) {
+    fprintf(file, "dps,stdError,varianceReduction,samples,duration,events");
+    for (size_t i = 0; i < NumDamageSources; ++i) {
+        const char *name = getDamageSourceName(DamageSource(i));
+        fprintf(file, ",%sDamage,%sCount", name, name);
+    }
+    for (unsigned i = 0; i < totals.numTargets; ++i) {
+        fprintf(file, ",target%uDamage", i);
+    }
+    fprintf(file, ",spentRage,wastedRageSpillOver,wastedRageStanceSwap");
+    for (size_t i = 0; i < NumAttackTables; ++i) {
+        for (size_t j = 0; j < NumHitKinds; ++j) {
+            fprintf(file, ",%s%s", getAttackTableName(AttackTableKind(i)),
+                    getHitKindName(HitKind(j)));
+        }
+    }
+    for (size_t i = 0; i < NumProcs; ++i) {
+        const char *name = getProcName(ProcKind(i));
+        fprintf(file, ",%sAttempts,%sProcs", name, name);
+    }
+    fprintf(file, "\n");
+
+    fprintf(file, "%.4f,", est.mean);
+    printEstimateVal(file, est.stdError, "");
+    fprintf(file, ",");
+    printEstimateVal(file, est.varianceReduction, "");
+    fprintf(file, ",%zu,%.1f,%zu", est.samples, totals.duration, totals.numEvents);
+    for (const FightStats::DamageStat &stat : totals.damageStats) {
+        fprintf(file, ",%.2f,%u", stat.damage, stat.count);
+    }
+    for (unsigned i = 0; i < totals.numTargets; ++i) {
+        fprintf(file, ",%.2f", totals.targetDamage[i]);
+    }
+    fprintf(file, ",%u,%u,%u", totals.spentRage, totals.wastedRageSpillOver,
+            totals.wastedRageStanceSwap);
+    for (const HitStats &hitStats : totals.hitStats) {
+        size_t rolls = hitStats.getNumRolls();
+        for (size_t count : hitStats.counts) {
+            fprintf(file, ",%.4f", getPercent(count, rolls));
+        }
+    }
+    for (const FightStats::ProcStat &stat : totals.procStats) {
+        fprintf(file, ",%zu,%zu", stat.attempts, stat.procs);
+    }
+    fprintf(file, "\n");
+}
+
+// Written by --result=binary, in native byte order. The layout changes
+// with the lists above, which the version and the counts identify.
+struct ResultRecord {
+    char magic[4] = { 'D', 'P', 'S', 'R' };
+    // 2: damage is a double
+    // 3: per target damage
+    uint32_t version = 3;
+    uint32_t numDamageSources = NumDamageSources;
+    uint32_t numAttackTables = NumAttackTables;
+    uint32_t numHitKinds = NumHitKinds;
+    uint32_t numProcs = NumProcs;
+    uint32_t maxTargets = MaxTargets;
+    // Of the targetDamage entries, the rest are 0
+    uint32_t numTargets = 0;
+
+    double dps = 0.0;
+    double stdError = 0.0;
+    double varianceReduction = 0.0;
+    double duration = 0.0;
+    uint64_t samples = 0;
+    uint64_t events = 0;
+
+    double damage[NumDamageSources] = { 0.0 };
+    uint64_t damageCounts[NumDamageSources] = { 0 };
+    double targetDamage[MaxTargets] = { 0.0 };
+    uint64_t spentRage = 0;
+    uint64_t wastedRageSpillOver = 0;
+    uint64_t wastedRageStanceSwap = 0;
+    uint64_t hitCounts[NumAttackTables][NumHitKinds] = { { 0 } };
+    uint64_t procAttempts[NumProcs] = { 0 };
+    uint64_t procs[NumProcs] = { 0 };
+
+    ResultRecord(const Estimate &est, const FightStats &totals) {
+        dps = est.mean;
+        stdError = est.stdError;
+        varianceReduction = est.varianceReduction;
+        duration = totals.duration;
+        samples = est.samples;
+        events = totals.numEvents;
+        for (size_t i = 0; i < NumDamageSources; ++i) {
+            damage[i] = totals.damageStats[i].damage;
+            damageCounts[i] = totals.damageStats[i].count;
+        }
+        numTargets = totals.numTargets;
+        for (size_t i = 0; i < MaxTargets; ++i) {
+            targetDamage[i] = totals.targetDamage[i];
+        }
+        spentRage = totals.spentRage;
+        wastedRageSpillOver = totals.wastedRageSpillOver;
+        wastedRageStanceSwap = totals.wastedRageStanceSwap;
+        for (size_t i = 0; i < NumAttackTables; ++i) {
+            for (size_t j = 0; j < NumHitKinds; ++j) {
+                hitCounts[i][j] = totals.hitStats[i].counts[j];
+            }
+        }
+        for (size_t i = 0; i < NumProcs; ++i) {
+            procAttempts[i] = totals.procStats[i].attempts;
+            procs[i] = totals.procStats[i].procs;
+        }
+    }
+};
+
+// 'totals' may only be null for the kinds that don't need fight statistics
+void emitResult(ResultKind rk, const Estimate &est, const FightStats *totals) {
+    assert(totals || !needsFightStats(rk));
+    switch (rk) {
+    case RK_dps:
+        printf("%.2f\n", est.mean);
+        return;
+    case RK_estimate:
+        // DPS, standard error, variance reduction factor
+        printf("%.2f %.2f %.2f\n", est.mean, est.stdError, est.varianceReduction);
+        return;
+    case RK_replicas:
+        // Printed per replica instead
+        return;
+    case RK_json:
+        printJson(stdout, est, *totals);
+        return;
+    case RK_csv:
+        printCsv(stdout, est, *totals);
+        return;
+    case RK_binary: {
+        ResultRecord record(est, *totals);
+        if (::fwrite(&record, sizeof(record), 1, stdout) != 1) {
+            fatal() << "Failed to write the binary result\n";
+        }
+        return;
+    }
+    }
+    assert(0);
+}
+
+// Tuning //////////////////////////////////////////////////////////////////////
+
+// What '--tune=rotation' tunes
+const char *const rotationTuneAxes[] = {
+    "whirlwindMinRage:5",
+    "whirlwindOverpowerMargin:5",
+    "overpowerStanceHold:0.5",
+};
+
+// Two-sided 95% confidence
+const double confidenceZ = 1.96;
+// Limits on the moves of the descent, and on how many steps the confidence
+// interval of a param is searched over on either side of the best value
+const unsigned maxTuneMoves = 100;
+const unsigned maxTuneSteps = 20;
+
+void printParamVal(FILE *file, const Params &params, StrView name) {
+    #define X(NAME, TYPE, VALUE)                    \
+    if (name == #NAME) {                            \
+        printVal(file, params.NAME);                \
+        return;                                     \
+    }
+    PARAM_LIST
+    #undef X
+    assert(0);
+}
+
+// Coordinate descent over params given as sweep axes. A point is a number
+// of steps along each axis from the base params. Every point is run on the
+// same random streams, so two points are compared by their per-replica
+// differences, in which most of the noise cancels. The neighbours of the
+// current point are all run at once, and the descent moves to the best one
+// that is significantly better.
+struct Tuner {
+    using Point = std::vector<int>;
+
+    const Params &base;
+    const std::vector<SweepAxis> &axes;
+    ThreadPool &pool;
+    const Instrumentation instrumentation;
+    const unsigned seed;
+    const unsigned numReplicas;
+    const bool antithetic;
+    const bool controlVariates;
+    const double replicaDuration;
+
+    struct Run {
+        std::unique_ptr<Config> config;
+        std::unique_ptr<SimJob> job;
+    };
+    std::map<Point, Run> runs;
+
+    Tuner(const Params &base, const std::vector<SweepAxis> &axes,
+          ThreadPool &pool, Instrumentation instrumentation, unsigned seed,
+          unsigned numReplicas, bool antithetic, bool controlVariates,
+          double replicaDuration) :
+        base(base), axes(axes), pool(pool), instrumentation(instrumentation),
+        seed(seed), numReplicas(numReplicas), antithetic(antithetic),
+        controlVariates(controlVariates), replicaDuration(replicaDuration) { }
+
+    // False if the point is out of range
+    bool getParams(const Point &point, Params &out) const {
+        out = base;
+        for (size_t i = 0; i < axes.size(); ++i) {
+            if (!offsetParam(out, axes[i].name, axes[i].step * point[i]))
+                return false;
+        }
+        return true;
+    }
+    bool isValid(const Point &point) const {
+        Params tmp;
+        return getParams(point, tmp);
+    }
+
+    // Run every point that hasn't been run yet, in parallel
+    void run(const std::vector<Point> &points) {
+        for (const Point &point : points) {
+            if (runs.count(point))
+                continue;
+            Params params;
+            bool valid = getParams(point, params);
+            assert(valid);
+            (void)valid;
+            Run &r = runs[point];
+            r.config.reset(new Config(params));
+            // Config id 0 for all, so the points share their streams
+            r.job.reset(SimJob::create(instrumentation, *r.config, seed, 0,
+                                       0, numReplicas, antithetic,
+                                       replicaDuration));
+            r.job->submit(pool);
+        }
+        pool.wait();
+    }
+
+    Estimate estimate(const Point &point) const {
+        return estimateDPS(runs.at(point).job->results, antithetic, controlVariates);
+    }
+    // DPS of 'a' minus DPS of 'b', from the paired replicas
+    Estimate compare(const Point &a, const Point &b) const {
+        const std::vector<ReplicaResult> &ra = runs.at(a).job->results;
+        const std::vector<ReplicaResult> &rb = runs.at(b).job->results;
+        std::vector<ReplicaResult> diffs(ra.size());
+        for (size_t i = 0; i < ra.size(); ++i) {
+            diffs[i].dps = ra[i].dps - rb[i].dps;
+            for (size_t k = 0; k < ra[i].controls.size(); ++k) {
+                diffs[i].controls.push_back(ra[i].controls[k] - rb[i].controls[k]);
+            }
+        }
+        return estimateDPS(diffs, antithetic, controlVariates);
+    }
+
+    Point descend() {
+        Point cur(axes.size(), 0);
+        for (unsigned move = 0; move < maxTuneMoves; ++move) {
+            std::vector<Point> candidates;
+            for (size_t i = 0; i < axes.size(); ++i) {
+                for (int dir : { -1, 1 }) {
+                    Point next = cur;
+                    next[i] += dir;
+                    if (isValid(next)) {
+                        candidates.push_back(next);
+                    }
+                }
+            }
+            candidates.push_back(cur);
+            run(candidates);
+            candidates.pop_back();
+
+            const Point *best = nullptr;
+            double bestGain = 0.0;
+            for (const Point &point : candidates) {
+                Estimate diff = compare(point, cur);
+                if (diff.mean - confidenceZ * diff.stdError > 0.0 &&
+                    diff.mean > bestGain) {
+                    best = &point;
+                    bestGain = diff.mean;
+                }
+            }
+            if (!best)
+                break;
+            log("Tune move %u: +%.2f dps\n", move, bestGain);
+            cur = *best;
+        }
+        return cur;
+    }
+
+    // Widen the interval of each axis around 'best' step by step, for as
+    // long as the points aren't significantly worse than 'best'
+    void getIntervals(const Point &best, Point &low, Point &high) {
+        low = best;
+        high = best;
+        std::vector<bool> open(2 * axes.size(), true);
+        for (unsigned step = 1; step <= maxTuneSteps; ++step) {
+            std::vector<Point> points;
+            std::vector<size_t> sides;
+            for (size_t side = 0; side < open.size(); ++side) {
+                if (!open[side])
+                    continue;
+                Point point = best;
+                point[side / 2] += side % 2 ? int(step) : -int(step);
+                if (!isValid(point)) {
+                    open[side] = false;
+                    continue;
+                }
+                points.push_back(point);
+                sides.push_back(side);
+            }
+            if (points.empty())
+                break;
+            run(points);
+            for (size_t i = 0; i < points.size(); ++i) {
+                Estimate diff = compare(points[i], best);
+                size_t side = sides[i];
+                if (diff.mean + confidenceZ * diff.stdError < 0.0) {
+                    open[side] = false;
+                } else if (side % 2) {
+                    high[side / 2] = points[i][side / 2];
+                } else {
+                    low[side / 2] = points[i][side / 2];
+                }
+            }
+        }
+    }
+
+    // 'name,value,low,high' for each param, then the DPS of the best point
+    // and its gain over the base params
+    void print(FILE *file) {
+        const Point start(axes.size(), 0);
+        Point best = descend();
+        Point low, high;
+        getIntervals(best, low, high);
+
+        fprintf(file, "param,value,low,high\n");
+        for (size_t i = 0; i < axes.size(); ++i) {
+            Params params;
+            const Point *points[] = { &best, &low, &high };
+            fprintf(file, "%s", axes[i].name.str().c_str());
+            for (const Point *point : points) {
+                Point p = best;
+                p[i] = (*point)[i];
+                getParams(p, params);
+                fprintf(file, ",");
+                printParamVal(file, params, axes[i].name);
+            }
+            fprintf(file, "\n");
+        }
+        Estimate est = estimate(best);
+        fprintf(file, "dps,%.2f,%.2f,%.2f\n", est.mean,
+                est.mean - confidenceZ * est.stdError,
+                est.mean + confidenceZ * est.stdError);
+        Estimate gain = compare(best, start);
+        fprintf(file, "gain,%.2f,%.2f,%.2f\n", gain.mean,
+                gain.mean - confidenceZ * gain.stdError,
+                gain.mean + confidenceZ * gain.stdError);
+    }
+};
+
+// Adaptive sweeps /////////////////////////////////////////////////////////////
+// With --sweep-tolerance=DPS a sweep axis covers the same range as the
+// uniform sweep, but starts from a few points and only adds more where
+// they're needed. The fitted curve is the linear interpolation of the
+// points. Each round, an interval is split in the middle while its
+// interpolation error, estimated from the curvature at its ends, is over the
+// tolerance, and a point gets twice the replicas while its standard error
+// is. Unsigned params can't be split finer than 1. Whatever is still over
+// the tolerance when the rounds or a point's replicas run out is reported
+// on stderr.
+
+const unsigned adaptiveStartPoints = 5;
+const unsigned maxAdaptiveRounds = 12;
+// Most replicas a point gets, as a multiple of --replicas
+const unsigned maxAdaptiveReplicaFactor = 64;
+
+double getParamVal(const Params &params, StrView name) {
+    #define X(NAME, TYPE, VALUE)                    \
+    if (name == #NAME) {                            \
+        return double(params.NAME);                 \
+    }
+    PARAM_LIST
+    #undef X
+    assert(0);
+    return 0.0;
+}
+
+struct AdaptiveSweep {
+    const Params &base;
+    const std::vector<SweepAxis> &axes;
+    ThreadPool &pool;
+    const Instrumentation instrumentation;
+    const unsigned seed;
+    const unsigned numReplicas;
+    const bool antithetic;
+    const bool controlVariates;
+    const double replicaDuration;
+    const bool commonRandom;
+    const double tolerance;
+    // Of the uniform sweep, which sets the range and where the fitted
+    // curve is printed
+    const unsigned numGridPoints;
+
+    struct Point {
+        // The param's value
+        double x = 0.0;
+        unsigned configId = 0;
+        std::unique_ptr<Config> config;
+        // A batch of replicas each, which add up
+        std::vector<std::unique_ptr<SimJob>> jobs;
+        unsigned numReplicas = 0;
+        Estimate est;
+    };
+    // Sorted by x, per axis
+    std::vector<std::vector<std::unique_ptr<Point>>> points;
+    std::vector<double> baseVals;
+    unsigned nextConfigId = 0;
+    size_t numJobs = 0;
+
+    AdaptiveSweep(const Params &base, const std::vector<SweepAxis> &axes,
+                  ThreadPool &pool, Instrumentation instrumentation,
+                  unsigned seed, unsigned numReplicas, bool antithetic,
+                  bool controlVariates, double replicaDuration,
+                  bool commonRandom, double tolerance, unsigned numGridPoints) :
+        base(base), axes(axes), pool(pool), instrumentation(instrumentation),
+        seed(seed), numReplicas(numReplicas), antithetic(antithetic),
+        controlVariates(controlVariates), replicaDuration(replicaDuration),
+        commonRandom(commonRandom), tolerance(tolerance),
+        numGridPoints(numGridPoints), points(axes.size()) {
+        for (const SweepAxis &axis : axes) {
+            baseVals.push_back(getParamVal(base, axis.name));
+        }
+    }
+
+    void addReplicas(Point &point) {
+        unsigned count = point.numReplicas ? point.numReplicas : numReplicas;
+        // Every point gets its own streams unless they're asked to share
+        unsigned configId = commonRandom ? 0 : point.configId;
+        point.jobs.emplace_back(SimJob::create(instrumentation, *point.config,
+                                               seed, configId, point.numReplicas,
+                                               count, antithetic, replicaDuration));
+        point.jobs.back()->submit(pool);
+        point.numReplicas += count;
+        ++numJobs;
+    }
+
+    // False if the point is out of range, or rounds to one that exists
+    bool addPoint(size_t axisIdx, double x) {
+        Params params = base;
+        if (!offsetParam(params, axes[axisIdx].name, x - baseVals[axisIdx]))
+            return false;
+        x = getParamVal(params, axes[axisIdx].name);
+        std::vector<std::unique_ptr<Point>> &axisPoints = points[axisIdx];
+        auto it = std::lower_bound(axisPoints.begin(), axisPoints.end(), x,
+            [](const std::unique_ptr<Point> &p, double val) { return p->x < val; });
+        if (it != axisPoints.end() && (*it)->x == x)
+            return false;
+        std::unique_ptr<Point> point(new Point);
+        point->x = x;
+        point->configId = nextConfigId++;
+        point->config.reset(new Config(params));
+        Point &ref = *point;
+        axisPoints.insert(it, std::move(point));
+        addReplicas(ref);
+        return true;
+    }
+
+    void update() {
+        for (auto &axisPoints : points) {
+            for (auto &point : axisPoints) {
+                std::vector<ReplicaResult> results;
+                for (const auto &job : point->jobs) {
+                    results.insert(results.end(), job->results.begin(),
+                                   job->results.end());
+                }
+                point->est = estimateDPS(results, antithetic, controlVariates);
+            }
+        }
+    }
+
+    // Second derivative from the point and its neighbours, zero at the ends
+    static double getCurvature(const std::vector<std::unique_ptr<Point>> &ps, size_t i) {
+        if (i == 0 || i + 1 >= ps.size())
+            return 0.0;
+        const Point &a = *ps[i - 1];
+        const Point &b = *ps[i];
+        const Point &c = *ps[i + 1];
+        double left = (b.est.mean - a.est.mean) / (b.x - a.x);
+        double right = (c.est.mean - b.est.mean) / (c.x - b.x);
+        return 2.0 * (right - left) / (c.x - a.x);
+    }
+    // Of linear interpolation between points i and i + 1
+    static double getInterpolationError(const std::vector<std::unique_ptr<Point>> &ps,
+                                        size_t i) {
+        double h = ps[i + 1]->x - ps[i]->x;
+        double curvature = std::max(std::fabs(getCurvature(ps, i)),
+                                    std::fabs(getCurvature(ps, i + 1)));
+        return h * h * curvature / 8.0;
+    }
+
+    // Start the runs of one round. False if there's nothing left to refine.
+    bool refine() {
+        bool refined = false;
+        for (size_t a = 0; a < axes.size(); ++a) {
+            std::vector<std::unique_ptr<Point>> &ps = points[a];
+            // Decided from this round's estimates before adding any points
+            std::vector<double> splits;
+            for (size_t i = 0; i + 1 < ps.size(); ++i) {
+                if (getInterpolationError(ps, i) > tolerance) {
+                    splits.push_back((ps[i]->x + ps[i + 1]->x) / 2.0);
+                }
+            }
+            for (auto &point : ps) {
+                if (point->est.stdError > tolerance &&
+                    point->numReplicas < numReplicas * maxAdaptiveReplicaFactor) {
+                    addReplicas(*point);
+                    refined = true;
+                }
+            }
+            for (double x : splits) {
+                refined |= addPoint(a, x);
+            }
+        }
+        return refined;
+    }
+
+    void run() {
+        for (size_t a = 0; a < axes.size(); ++a) {
+            double range = axes[a].step * (numGridPoints - 1);
+            for (unsigned i = 0; i < adaptiveStartPoints; ++i) {
+                addPoint(a, baseVals[a] + range * i / (adaptiveStartPoints - 1));
+            }
+        }
+        pool.wait();
+        update();
+        for (unsigned round = 0; round < maxAdaptiveRounds && refine(); ++round) {
+            pool.wait();
+            update();
+            log("Sweep round %u: %zu runs\n", round, numJobs);
+        }
+    }
+
+    // Each point and interval still over the tolerance, and why
+    void warnUnmet(FILE *file) const {
+        for (size_t a = 0; a < axes.size(); ++a) {
+            std::string label = axes[a].label;
+            const std::vector<std::unique_ptr<Point>> &ps = points[a];
+            for (const auto &point : ps) {
+                if (point->est.stdError > tolerance) {
+                    fprintf(file, "Warning: sweep %s at %g has a standard error of %.2f, %s\n",
+                            label.c_str(), point->x, point->est.stdError,
+                            point->numReplicas >= numReplicas * maxAdaptiveReplicaFactor ?
+                            "at the most replicas a point gets" : "after the last round");
+                }
+            }
+            for (size_t i = 0; i + 1 < ps.size(); ++i) {
+                double error = getInterpolationError(ps, i);
+                if (error > tolerance) {
+                    Params mid = base;
+                    double x = (ps[i]->x + ps[i + 1]->x) / 2.0;
+                    bool canSplit = offsetParam(mid, axes[a].name, x - baseVals[a]) &&
+                                    getParamVal(mid, axes[a].name) != ps[i]->x &&
+                                    getParamVal(mid, axes[a].name) != ps[i + 1]->x;
+                    fprintf(file, "Warning: sweep %s from %g to %g has an interpolation "
+                            "error of %.2f, %s\n", label.c_str(), ps[i]->x, ps[i + 1]->x,
+                            error, canSplit ? "after the last round" : "and can't be split");
+                }
+            }
+        }
+    }
+
+    // Linear interpolation of the points, flat outside them
+    static void interpolate(const std::vector<std::unique_ptr<Point>> &ps, double x,
+                            double &mean, double &stdError) {
+        auto it = std::lower_bound(ps.begin(), ps.end(), x,
+            [](const std::unique_ptr<Point> &p, double val) { return p->x < val; });
+        if (it == ps.begin() || it == ps.end()) {
+            const Point &p = it == ps.end() ? *ps.back() : *ps.front();
+            mean = p.est.mean;
+            stdError = p.est.stdError;
+            return;
+        }
+        const Point &a = **(it - 1);
+        const Point &b = **it;
+        double t = (x - a.x) / (b.x - a.x);
+        mean = a.est.mean + t * (b.est.mean - a.est.mean);
+        stdError = a.est.stdError + t * (b.est.stdError - a.est.stdError);
+    }
+
+    // 'axis,x,dps,stdError,kind' rows: the points of each axis with kind
+    // 'point', then the fitted curve at the points of the uniform sweep with
+    // kind 'fit' and the interpolated standard error
+    void print(FILE *file) const {
+        fprintf(file, "axis,x,dps,stdError,kind\n");
+        for (size_t a = 0; a < axes.size(); ++a) {
+            std::string label = axes[a].label;
+            for (const auto &point : points[a]) {
+                fprintf(file, "%s,%g,%.2f,%.2f,point\n", label.c_str(), point->x,
+                        point->est.mean, point->est.stdError);
+            }
+            for (unsigned i = 0; i < numGridPoints; ++i) {
+                double x = baseVals[a] + axes[a].step * i;
+                double mean, stdError;
+                interpolate(points[a], x, mean, stdError);
+                fprintf(file, "%s,%g,%.2f,%.2f,fit\n", label.c_str(), x, mean, stdError);
+            }
+        }
+    }
+};
+
+// Sensitivity /////////////////////////////////////////////////////////////////
+// --sensitivity=NAME:LOW:HIGH (repeatable) estimates how much of the
+// variance of DPS each param explains when the params vary independently
+// and uniformly over their ranges. With N = --sensitivity-samples, the
+// Saltelli design runs N Sobol points A, N more B, and for each param the
+// points of A with that param taken from B, so the cost is N * (params + 2)
+// runs rather than a grid's. Every run uses the same random streams. The
+// first-order index of a param is the share of the variance it explains
+// alone, and the total-effect index the share including its interactions
+// (Saltelli et al., "Variance based sensitivity analysis of model output",
+// with Jansen's estimator for the latter). Their standard errors come from
+// bootstrapping the N points.
+
+const unsigned defaultSensitivitySamples = 64;
+// Runs in flight at once, to bound the memory of the fights
+const size_t sensitivityBatchSize = 256;
+const unsigned sensitivityBootstraps = 200;
+
+struct SensitivityRange {
+    StrView name;
+    double low = 0.0;
+    double high = 0.0;
+};
+
+bool parseVal(StrView str, SensitivityRange &out) {
+    auto colon = str.find(':');
+    if (colon == StrView::npos)
+        return false;
+    out.name = str.substr(0, colon);
+    std::string rest = str.substr(colon + 1);
+    auto colon2 = rest.find(':');
+    if (colon2 == std::string::npos)
+        return false;
+    std::string lowStr = rest.substr(0, colon2);
+    std::string highStr = rest.substr(colon2 + 1);
+    if (!parseVal(StrView(lowStr), out.low) || !parseVal(StrView(highStr), out.high))
+        return false;
+    Params test;
+    return out.low >= 0.0 && out.low <= out.high && offsetParam(test, out.name, 0.0);
+}
+
+struct SensitivityAnalysis {
+    const Params &base;
+    const std::vector<SensitivityRange> &ranges;
+    ThreadPool &pool;
+    const Instrumentation instrumentation;
+    const unsigned seed;
+    const unsigned numReplicas;
+    const bool antithetic;
+    const bool controlVariates;
+    const double replicaDuration;
+    const unsigned numSamples;
+
+    // DPS at A, at B, and at A with param i from B
+    std::vector<double> dpsA;
+    std::vector<double> dpsB;
+    std::vector<std::vector<double>> dpsAB;
+    size_t numRuns = 0;
+
+    SensitivityAnalysis(const Params &base, const std::vector<SensitivityRange> &ranges,
+                        ThreadPool &pool, Instrumentation instrumentation,
+                        unsigned seed, unsigned numReplicas, bool antithetic,
+                        bool controlVariates, double replicaDuration,
+                        unsigned numSamples) :
+        base(base), ranges(ranges), pool(pool), instrumentation(instrumentation),
+        seed(seed), numReplicas(numReplicas), antithetic(antithetic),
+        controlVariates(controlVariates), replicaDuration(replicaDuration),
+        numSamples(numSamples) {
+        // The base params are only complete once all the arguments are
+        // parsed, so the ranges are checked against them here
+        for (const SensitivityRange &r : ranges) {
+            for (double val : { r.low, r.high }) {
+                Params params = base;
+                setVal(params, r.name, val);
+            }
+        }
+    }
+
+    static void setVal(Params &params, StrView name, double val) {
+        std::string error;
+        if (!offsetParam(params, name, val - getParamVal(params, name), &error)) {
+            fatal() << "Sensitivity sample " << name << "=" << val << " is out of range"
+                    << (error.empty() ? "" : ": ") << error << "\n";
+        }
+    }
+
+    // 'unit' in [0, 1) per param. Ranges that are valid on their own can
+    // still clash, e.g. a minimum and a maximum weapon damage.
+    Params getParams(const std::vector<double> &unit) const {
+        Params params = base;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            const SensitivityRange &r = ranges[i];
+            setVal(params, r.name, r.low + unit[i] * (r.high - r.low));
+        }
+        return params;
+    }
+
+    // Run the points in batches, in parallel within a batch
+    std::vector<double> run(const std::vector<std::vector<double>> &points) {
+        std::vector<double> out;
+        for (size_t start = 0; start < points.size(); start += sensitivityBatchSize) {
+            size_t end = std::min(points.size(), start + sensitivityBatchSize);
+            std::vector<std::unique_ptr<Config>> configs;
+            std::vector<std::unique_ptr<SimJob>> jobs;
+            for (size_t i = start; i < end; ++i) {
+                configs.emplace_back(new Config(getParams(points[i])));
+                // Config id 0 for all, so the points share their streams
+                jobs.emplace_back(SimJob::create(instrumentation, *configs.back(),
+                                                 seed, 0, 0, numReplicas,
+                                                 antithetic, replicaDuration));
+                jobs.back()->submit(pool);
+            }
+            pool.wait();
+            for (const auto &job : jobs) {
+                out.push_back(estimateDPS(job->results, antithetic, controlVariates).mean);
+            }
+            numRuns += jobs.size();
+        }
+        return out;
+    }
+
+    void run() {
+        const size_t d = ranges.size();
+        SobolSequence sobol(2 * d);
+        std::vector<std::vector<double>> a(numSamples), b(numSamples);
+        std::vector<double> point;
+        for (unsigned j = 0; j < numSamples; ++j) {
+            sobol.next(point);
+            a[j].assign(point.begin(), point.begin() + d);
+            b[j].assign(point.begin() + d, point.end());
+        }
+        // All of the design at once, so the batches are full
+        std::vector<std::vector<double>> all = a;
+        all.insert(all.end(), b.begin(), b.end());
+        for (size_t i = 0; i < d; ++i) {
+            for (unsigned j = 0; j < numSamples; ++j) {
+                all.push_back(a[j]);
+                all.back()[i] = b[j][i];
+            }
+        }
+        std::vector<double> dps = run(all);
+        dpsA.assign(dps.begin(), dps.begin() + numSamples);
+        dpsB.assign(dps.begin() + numSamples, dps.begin() + 2 * numSamples);
+        dpsAB.resize(d);
+        for (size_t i = 0; i < d; ++i) {
+            auto first = dps.begin() + (2 + i) * numSamples;
+            dpsAB[i].assign(first, first + numSamples);
+        }
+    }
+
+    // First-order and total-effect indices of param i over the sample
+    // indices 'samples'
+    void getIndices(size_t i, const std::vector<unsigned> &samples,
+                    double &first, double &total) const {
+        std::vector<double> all;
+        for (unsigned j : samples) {
+            all.push_back(dpsA[j]);
+            all.push_back(dpsB[j]);
+        }
+        double mean = getMean(all);
+        double variance = getVariance(all);
+        // Centered, which takes the mean's large share out of the noise
+        double sumFirst = 0.0;
+        double sumTotal = 0.0;
+        for (unsigned j : samples) {
+            sumFirst += (dpsB[j] - mean) * (dpsAB[i][j] - dpsA[j]);
+            sumTotal += (dpsA[j] - dpsAB[i][j]) * (dpsA[j] - dpsAB[i][j]);
+        }
+        first = sumFirst / samples.size() / variance;
+        total = sumTotal / (2.0 * samples.size()) / variance;
+    }
+
+    // 'param,low,high,first,firstError,total,totalError' rows
+    void print(FILE *file) const {
+        std::vector<unsigned> samples(numSamples);
+        for (unsigned j = 0; j < numSamples; ++j) {
+            samples[j] = j;
+        }
+        // Resampled the same way for every param
+        std::vector<std::vector<unsigned>> resamples(sensitivityBootstraps);
+        RandomStream rng(seed, 0);
+        for (auto &resample : resamples) {
+            for (unsigned j = 0; j < numSamples; ++j) {
+                resample.push_back(unsigned(uint64_t(rng()) * numSamples >> 32));
+            }
+        }
+
+        fprintf(file, "param,low,high,first,firstError,total,totalError\n");
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            double first, total;
+            getIndices(i, samples, first, total);
+            std::vector<double> firsts, totals;
+            for (const auto &resample : resamples) {
+                double f, t;
+                getIndices(i, resample, f, t);
+                firsts.push_back(f);
+                totals.push_back(t);
+            }
+            const SensitivityRange &r = ranges[i];
+            fprintf(file, "%s,%g,%g,%.4f,%.4f,%.4f,%.4f\n", r.name.str().c_str(),
+                    r.low, r.high, first, std::sqrt(getVariance(firsts)),
+                    total, std::sqrt(getVariance(totals)));
+        }
+    }
+};
+
+// Gear ////////////////////////////////////////////////////////////////////////
+// An item database is a text file with one item per line:
+//     SLOT NAME FIELD=VALUE...
+// The fields are params the item adds to (e.g. strength=20 hitBonus=1), and
+// for weapons also min, max, speed and type. Weapons go in the twoHand,
+// oneHand (either hand), mainHand or offHand slots. Items in the base slot
+// are always worn, e.g. the character's own stats. Any other slot holds one
+// item, or COUNT items after a line 'slot NAME COUNT'. Item names can't
+// contain spaces, and '#' starts a comment.
+
+#define WEAPON_TYPE_LIST                                                       \
+    X(other)                                                                   \
+    X(sword)                                                                   \
+    X(axe)                                                                     \
+    X(dagger)
+
+enum WeaponType {
+    #define X(NAME) WT_##NAME,
+    WEAPON_TYPE_LIST
+    #undef X
+};
+
+bool parseVal(StrView str, WeaponType &out) {
+    #define X(NAME)        \
+    if (str == #NAME) {    \
+        out = WT_##NAME;   \
+        return true;       \
+    }
+    WEAPON_TYPE_LIST
+    #undef X
+    return false;
+}
+
+struct Item {
+    std::string slot;
+    std::string name;
+
+    bool weapon = false;
+    unsigned damageMin = 0;
+    unsigned damageMax = 0;
+    double speed = 0.0;
+    WeaponType type = WT_other;
+
+    // Amount added to each of GearDB::stats
+    std::vector<double> stats;
+
+    bool fitsMainHand() const {
+        return slot == "oneHand" || slot == "mainHand";
+    }
+    bool fitsOffHand() const {
+        return slot == "oneHand" || slot == "offHand";
+    }
+
+    // At least as good as 'other' in everything DPS depends on, assuming
+    // no stat ever lowers DPS
+    bool dominates(const Item &other) const {
+        if (weapon != other.weapon)
+            return false;
+        if (weapon && (type != other.type || speed != other.speed ||
+                       damageMin < other.damageMin || damageMax < other.damageMax))
+            return false;
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (stats[i] < other.stats[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+struct GearDB {
+    // Params the items add to
+    std::vector<std::string> stats;
+    std::vector<Item> items;
+    std::map<std::string, unsigned> slotCounts;
+
+    static bool isWeaponSlot(StrView slot) {
+        return slot == "twoHand" || slot == "oneHand" ||
+               slot == "mainHand" || slot == "offHand";
+    }
+
+    unsigned getSlotCount(const std::string &slot) const {
+        auto it = slotCounts.find(slot);
+        return it == slotCounts.end() ? 1 : it->second;
+    }
+
+    size_t getStat(StrView name) {
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (stats[i] == name.str())
+                return i;
+        }
+        Params test;
+        if (!offsetParam(test, name, 0.0)) {
+            fatal() << "Items can't add to '" << name << "'\n";
+        }
+        stats.push_back(name);
+        return stats.size() - 1;
+    }
+
+    void load(StrView filename) {
+        std::string path = filename;
+        FILE *file = ::fopen(path.c_str(), "r");
+        if (!file) {
+            fatal() << "Failed to open '" << filename << "'\n";
+        }
+        char line[4096];
+        unsigned lineNum = 0;
+        while (::fgets(line, sizeof(line), file)) {
+            ++lineNum;
+            std::vector<StrView> tokens;
+            for (char *tok = ::strtok(line, " \t\r\n"); tok; tok = ::strtok(nullptr, " \t\r\n")) {
+                if (tok[0] == '#')
+                    break;
+                tokens.push_back(tok);
+            }
+            if (tokens.empty())
+                continue;
+            std::string where = path + ":" + std::to_string(lineNum) + ": ";
+            if (tokens[0] == "slot") {
+                unsigned count = 0;
+                if (tokens.size() != 3 || !parseVal(tokens[2], count) || count == 0) {
+                    fatal() << where << "Expected 'slot NAME COUNT'\n";
+                }
+                slotCounts[tokens[1]] = count;
+                continue;
+            }
+            if (tokens.size() < 2) {
+                fatal() << where << "Expected 'SLOT NAME FIELD=VALUE...'\n";
+            }
+            Item item;
+            item.slot = tokens[0];
+            item.name = tokens[1];
+            item.weapon = isWeaponSlot(tokens[0]);
+            for (size_t i = 2; i < tokens.size(); ++i) {
+                auto eq = tokens[i].find('=');
+                if (eq == StrView::npos) {
+                    fatal() << where << "Expected FIELD=VALUE, got '" << tokens[i] << "'\n";
+                }
+                StrView field = tokens[i].substr(0, eq);
+                StrView valStr = tokens[i].substr(eq + 1);
+                bool valid = true;
+                if (item.weapon && field == "min") {
+                    valid = parseVal(valStr, item.damageMin);
+                } else if (item.weapon && field == "max") {
+                    valid = parseVal(valStr, item.damageMax);
+                } else if (item.weapon && field == "speed") {
+                    valid = parseVal(valStr, item.speed);
+                } else if (item.weapon && field == "type") {
+                    valid = parseVal(valStr, item.type);
+                } else {
+                    size_t stat = getStat(field);
+                    item.stats.resize(stats.size(), 0.0);
+                    valid = parseVal(valStr, item.stats[stat]);
+                }
+                if (!valid) {
+                    fatal() << where << "Invalid value for " << field << ": '" << valStr << "'\n";
+                }
+            }
+            if (item.weapon && (item.speed <= 0.0 || item.damageMin > item.damageMax)) {
+                fatal() << where << "Weapons need a speed and min <= max\n";
+            }
+            items.push_back(std::move(item));
+        }
+        ::fclose(file);
+        for (Item &item : items) {
+            item.stats.resize(stats.size(), 0.0);
+        }
+    }
+};
+
+// The items of a group that fewer than 'count' others dominate. The others
+// can replace them in any set, so the rest can't be part of a better set.
+// Of identical items the first is kept.
+std::vector<const Item *> pruneDominated(const std::vector<const Item *> &group,
+                                         unsigned count) {
+    std::vector<const Item *> result;
+    for (size_t i = 0; i < group.size(); ++i) {
+        unsigned dominators = 0;
+        for (size_t j = 0; j < group.size(); ++j) {
+            if (j == i || !group[j]->dominates(*group[i]))
+                continue;
+            // Identical items dominate each other
+            if (j > i && group[i]->dominates(*group[j]))
+                continue;
+            ++dominators;
+        }
+        if (dominators < count) {
+            result.push_back(group[i]);
+        }
+    }
+    return result;
+}
+
+// A two-hander (off == nullptr) or a main and off hand weapon
+struct WeaponSet {
+    const Item *main = nullptr;
+    const Item *off = nullptr;
+};
+
+// Candidates for the best sets, the highest estimated DPS first
+const unsigned defaultGearCandidates = 20;
+const unsigned defaultGearTop = 5;
+
+// Finds the best gear sets for the talents in the base params. Dominated
+// items are pruned, then each weapon set gets a linear model of DPS in the
+// item stats, fitted by simulating small steps in each stat around an
+// average set. A branch and bound over the other slots keeps the sets the
+// models rate highest, skipping every branch whose bound (the best item
+// of each remaining slot) can't beat the current candidates. Hit past the
+// point where the white miss chance clamps at 0 counts for nothing. The
+// bound is exact for the models, but they're noisy linear estimates, so
+// the pruning is a heuristic that can miss the best set if it isn't among
+// the --gear-candidates the models rate highest. Only those candidates
+// are simulated in full, all in parallel on the same streams.
+struct GearOptimizer {
+    const Params &base;
+    const GearDB &db;
+    ThreadPool &pool;
+    const Instrumentation instrumentation;
+    const unsigned seed;
+    const unsigned numReplicas;
+    const bool antithetic;
+    const bool controlVariates;
+    const double replicaDuration;
+    const unsigned numCandidates;
+
+    struct Slot {
+        unsigned count = 1;
+        std::vector<const Item *> items;
+    };
+    std::vector<const Item *> baseItems;
+    std::vector<WeaponSet> weaponSets;
+    std::vector<Slot> slots;
+    size_t numPruned = 0;
+
+    struct Candidate {
+        double score = 0.0;
+        size_t weaponSet = 0;
+        std::vector<const Item *> items;
+    };
+    std::vector<Candidate> candidates;
+    size_t numBranches = 0;
+
+    struct Run {
+        std::unique_ptr<Config> config;
+        std::unique_ptr<SimJob> job;
+    };
+
+    GearOptimizer(const Params &base, const GearDB &db, ThreadPool &pool,
+                  Instrumentation instrumentation, unsigned seed,
+                  unsigned numReplicas, bool antithetic, bool controlVariates,
+                  double replicaDuration, unsigned numCandidates) :
+        base(base), db(db), pool(pool), instrumentation(instrumentation),
+        seed(seed), numReplicas(numReplicas), antithetic(antithetic),
+        controlVariates(controlVariates), replicaDuration(replicaDuration),
+        numCandidates(numCandidates) { }
+
+    void addStats(Params &params, const std::vector<double> &stats) const {
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (stats[i] != 0.0 && !offsetParam(params, db.stats[i], stats[i])) {
+                fatal() << "Items take " << db.stats[i] << " out of range\n";
+            }
+        }
+    }
+    // Base params with the base items and a weapon set
+    Params getWeaponSetParams(const WeaponSet &ws) const {
+        Params params = base;
+        for (const Item *item : baseItems) {
+            addStats(params, item->stats);
+        }
+        if (ws.main) {
+            params.dualWield = ws.off != nullptr;
+            params.mainHandDagger = ws.main->type == WT_dagger;
+            params.mainWeaponDamageMin = ws.main->damageMin;
+            params.mainWeaponDamageMax = ws.main->damageMax;
+            params.mainSwingTime = ws.main->speed;
+            // Weapon specializations are only modelled for the main hand
+            if (ws.main->type != WT_sword) {
+                params.swordSpecLevel = 0;
+            }
+            if (ws.main->type != WT_axe) {
+                params.axeSpecLevel = 0;
+            }
+            addStats(params, ws.main->stats);
+        }
+        if (ws.off) {
+            params.offWeaponDamageMin = ws.off->damageMin;
+            params.offWeaponDamageMax = ws.off->damageMax;
+            params.offSwingTime = ws.off->speed;
+            addStats(params, ws.off->stats);
+        }
+        return params;
+    }
+
+    void prune() {
+        std::vector<const Item *> twoHands, mainHands, offHands;
+        std::map<std::string, std::vector<const Item *>> slotItems;
+        for (const Item &item : db.items) {
+            if (item.slot == "base") {
+                baseItems.push_back(&item);
+            } else if (item.slot == "twoHand") {
+                twoHands.push_back(&item);
+            } else if (item.weapon) {
+                if (item.fitsMainHand()) {
+                    mainHands.push_back(&item);
+                }
+                if (item.fitsOffHand()) {
+                    offHands.push_back(&item);
+                }
+            } else {
+                slotItems[item.slot].push_back(&item);
+            }
+        }
+
+        // A one-hander dominated by two others can be replaced in either
+        // hand, whichever weapon is in the other hand
+        size_t numItems = db.items.size() - baseItems.size();
+        twoHands = pruneDominated(twoHands, 1);
+        mainHands = pruneDominated(mainHands, 2);
+        offHands = pruneDominated(offHands, 2);
+        for (const Item *item : twoHands) {
+            WeaponSet ws;
+            ws.main = item;
+            weaponSets.push_back(ws);
+        }
+        for (const Item *main : mainHands) {
+            for (const Item *off : offHands) {
+                if (main == off)
+                    continue;
+                WeaponSet ws;
+                ws.main = main;
+                ws.off = off;
+                weaponSets.push_back(ws);
+            }
+        }
+        if (weaponSets.empty()) {
+            // Keep the weapons in the params
+            weaponSets.emplace_back();
+        }
+
+        size_t numKept = 0;
+        for (auto &entry : slotItems) {
+            Slot slot;
+            slot.count = db.getSlotCount(entry.first);
+            slot.items = pruneDominated(entry.second, slot.count);
+            slot.count = std::min(slot.count, unsigned(slot.items.size()));
+            numKept += slot.items.size();
+            slots.push_back(std::move(slot));
+        }
+        // Weapons kept for either hand are only counted once
+        std::vector<const Item *> weapons = twoHands;
+        weapons.insert(weapons.end(), mainHands.begin(), mainHands.end());
+        weapons.insert(weapons.end(), offHands.begin(), offHands.end());
+        std::sort(weapons.begin(), weapons.end());
+        numKept += std::unique(weapons.begin(), weapons.end()) - weapons.begin();
+        numPruned = numItems - numKept;
+    }
+
+    // Linear model of one weapon set: DPS at the reference stats and its
+    // slope in each stat
+    struct Model {
+        double refDPS = 0.0;
+        std::vector<double> refStats;
+        std::vector<double> slopes;
+        // The most of each stat the slots can add that still helps
+        std::vector<double> caps;
+
+        double getBase() const {
+            double result = refDPS;
+            for (size_t i = 0; i < slopes.size(); ++i) {
+                result -= slopes[i] * refStats[i];
+            }
+            return result;
+        }
+        double getGain(size_t stat, double val) const {
+            if (slopes[stat] > 0.0) {
+                val = std::min(val, caps[stat]);
+            }
+            return slopes[stat] * val;
+        }
+        // Capped item by item, so the sum over a set is never below its
+        // score
+        double getContribution(const Item &item) const {
+            double result = 0.0;
+            for (size_t i = 0; i < slopes.size(); ++i) {
+                result += getGain(i, item.stats[i]);
+            }
+            return result;
+        }
+        double getScore(const std::vector<const Item *> &items) const {
+            double result = getBase();
+            for (size_t i = 0; i < slopes.size(); ++i) {
+                double total = 0.0;
+                for (const Item *item : items) {
+                    total += item->stats[i];
+                }
+                result += getGain(i, total);
+            }
+            return result;
+        }
+    };
+    std::vector<Model> models;
+
+    Run start(const Params &params) {
+        Run r;
+        r.config.reset(new Config(params));
+        // Config id 0 for all, so the runs share their streams
+        r.job.reset(SimJob::create(instrumentation, *r.config, seed, 0,
+                                   0, numReplicas, antithetic, replicaDuration));
+        r.job->submit(pool);
+        return r;
+    }
+    double getDPS(const Run &r) const {
+        return estimateDPS(r.job->results, antithetic, controlVariates).mean;
+    }
+
+    void fitModels() {
+        const size_t numStats = db.stats.size();
+        // The reference is the average item of each slot, and the step of
+        // each stat the most any single item has of it
+        std::vector<double> refStats(numStats, 0.0);
+        std::vector<double> steps(numStats, 1.0);
+        for (const Slot &slot : slots) {
+            for (const Item *item : slot.items) {
+                for (size_t i = 0; i < numStats; ++i) {
+                    refStats[i] += item->stats[i] * slot.count / slot.items.size();
+                    steps[i] = std::max(steps[i], std::ceil(item->stats[i]));
+                }
+            }
+        }
+
+        std::vector<Run> runs;
+        for (const WeaponSet &ws : weaponSets) {
+            Params ref = getWeaponSetParams(ws);
+            addStats(ref, refStats);
+            runs.push_back(start(ref));
+            for (size_t i = 0; i < numStats; ++i) {
+                Params stepped = ref;
+                if (!offsetParam(stepped, db.stats[i], steps[i])) {
+                    fatal() << "Items take " << db.stats[i] << " out of range\n";
+                }
+                runs.push_back(start(stepped));
+            }
+        }
+        pool.wait();
+
+        size_t idx = 0;
+        for (size_t w = 0; w < weaponSets.size(); ++w) {
+            Model model;
+            model.refStats = refStats;
+            const Config config(getWeaponSetParams(weaponSets[w]));
+            for (size_t i = 0; i < numStats; ++i) {
+                double cap = INFINITY;
+                if (db.stats[i] == "hitBonus") {
+                    cap = std::max(config.whiteMissChance * 100, 0.0);
+                }
+                model.caps.push_back(cap);
+            }
+            model.refDPS = getDPS(runs[idx++]);
+            for (size_t i = 0; i < numStats; ++i) {
+                model.slopes.push_back((getDPS(runs[idx++]) - model.refDPS) / steps[i]);
+            }
+            models.push_back(std::move(model));
+        }
+    }
+
+    // Branch and bound ////////////////////////////////////////////////////////
+    struct Search {
+        size_t weaponSet;
+        // Contribution of each item of each slot, and the most the slots
+        // from each index on can add
+        std::vector<std::vector<double>> contributions;
+        std::vector<double> bounds;
+        std::vector<const Item *> chosen;
+    };
+
+    void addCandidate(const Search &search, double score) {
+        Candidate c;
+        c.score = score;
+        c.weaponSet = search.weaponSet;
+        c.items = search.chosen;
+        auto pos = std::find_if(candidates.begin(), candidates.end(),
+                                [&](const Candidate &other) {
+            return other.score < score;
+        });
+        candidates.insert(pos, std::move(c));
+        if (candidates.size() > numCandidates) {
+            candidates.pop_back();
+        }
+    }
+    bool canBeat(double bound) const {
+        return candidates.size() < numCandidates || bound > candidates.back().score;
+    }
+
+    // Choose the items of slot 'slotIdx' from 'first' on, 'left' of them
+    // still to choose
+    void branch(Search &search, size_t slotIdx, size_t first, unsigned left,
+                double score, double slotBound) {
+        ++numBranches;
+        if (!canBeat(score + slotBound + search.bounds[slotIdx + 1]))
+            return;
+        const Slot &slot = slots[slotIdx];
+        if (left == 0) {
+            if (slotIdx + 1 == slots.size()) {
+                addCandidate(search, models[search.weaponSet].getScore(search.chosen));
+            } else {
+                const Slot &next = slots[slotIdx + 1];
+                branch(search, slotIdx + 1, 0, next.count, score,
+                       search.bounds[slotIdx + 1] - search.bounds[slotIdx + 2]);
+            }
+            return;
+        }
+        const std::vector<double> &contribs = search.contributions[slotIdx];
+        for (size_t i = first; i + left <= slot.items.size(); ++i) {
+            // The rest of this slot can't add more than its best remaining
+            // items
+            std::vector<double> rest(contribs.begin() + i + 1, contribs.end());
+            std::sort(rest.begin(), rest.end(), std::greater<double>());
+            double restBound = 0.0;
+            for (size_t j = 0; j + 1 < left; ++j) {
+                restBound += rest[j];
+            }
+            search.chosen.push_back(slot.items[i]);
+            branch(search, slotIdx, i + 1, left - 1, score + contribs[i], restBound);
+            search.chosen.pop_back();
+        }
+    }
+
+    void search() {
+        for (size_t w = 0; w < weaponSets.size(); ++w) {
+            const Model &model = models[w];
+            Search search;
+            search.weaponSet = w;
+            double score = model.getBase();
+            for (const Slot &slot : slots) {
+                std::vector<double> contribs;
+                for (const Item *item : slot.items) {
+                    contribs.push_back(model.getContribution(*item));
+                }
+                search.contributions.push_back(std::move(contribs));
+            }
+            // bounds[i] is the best the slots from i on can add
+            search.bounds.assign(slots.size() + 2, 0.0);
+            for (size_t i = slots.size(); i-- > 0;) {
+                std::vector<double> sorted = search.contributions[i];
+                std::sort(sorted.begin(), sorted.end(), std::greater<double>());
+                double best = 0.0;
+                for (unsigned j = 0; j < slots[i].count; ++j) {
+                    best += sorted[j];
+                }
+                search.bounds[i] = best + search.bounds[i + 1];
+            }
+            if (slots.empty()) {
+                addCandidate(search, score);
+                continue;
+            }
+            branch(search, 0, 0, slots[0].count, score,
+                   search.bounds[0] - search.bounds[1]);
+        }
+    }
+
+    // 'dps,stdError,items' for the best 'top' sets, best first
+    void print(FILE *file, unsigned top) {
+        prune();
+        fitModels();
+        search();
+
+        std::vector<Run> runs;
+        for (const Candidate &c : candidates) {
+            Params params = getWeaponSetParams(weaponSets[c.weaponSet]);
+            for (const Item *item : c.items) {
+                addStats(params, item->stats);
+            }
+            runs.push_back(start(params));
+        }
+        pool.wait();
+
+        std::vector<std::pair<Estimate, size_t>> results;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            results.emplace_back(estimateDPS(runs[i].job->results, antithetic,
+                                             controlVariates), i);
+        }
+        std::sort(results.begin(), results.end(),
+                  [](const std::pair<Estimate, size_t> &a,
+                     const std::pair<Estimate, size_t> &b) {
+            return a.first.mean > b.first.mean;
+        });
+
+        fprintf(file, "dps,stdError,items\n");
+        for (size_t i = 0; i < results.size() && i < top; ++i) {
+            const Estimate &est = results[i].first;
+            const Candidate &c = candidates[results[i].second];
+            const WeaponSet &ws = weaponSets[c.weaponSet];
+            fprintf(file, "%.2f,%.2f,", est.mean, est.stdError);
+            const char *sep = "";
+            for (const Item *item : { ws.main, ws.off }) {
+                if (item) {
+                    fprintf(file, "%s%s", sep, item->name.c_str());
+                    sep = " ";
+                }
+            }
+            for (const Item *item : c.items) {
+                fprintf(file, "%s%s", sep, item->name.c_str());
+                sep = " ";
+            }
+            fprintf(file, "\n");
+        }
+    }
+};
+
+// Surrogate ///////////////////////////////////////////////////////////////////
+// --surrogate=FILE answers from a model of earlier results instead of
+// simulating when the model's predicted error is within
+// --surrogate-tolerance. Otherwise the query is simulated, and the result is
+// added to the model and appended to FILE so later sessions start from it.
+// The file has one result per line:
+//     DPS STDERR NAME=VALUE...
+// with the params that differ from their defaults.
+//
+// Results are grouped by build, i.e. by every param other than the stats
+// below. The model of a build is a Gaussian process over the stats, each
+// scaled by its correlation length, around the weighted mean of the
+// results. The predicted error is the posterior standard deviation, which
+// grows away from the results up to their spread around the mean, but at
+// least surrogatePriorSpread of the mean, so a few close results don't
+// make the model sure of itself everywhere. A linear trend would
+// extrapolate further, but confidently past the hit cap. The model only
+// interpolates: queries outside the convex hull of the results, or further
+// than the fitted length scale from all of them, get an infinite error.
+
+#define SURROGATE_INPUT_LIST                                                   \
+    X(strength, 50.0)                                                          \
+    X(agility, 50.0)                                                           \
+    X(bonusAttackPower, 100.0)                                                 \
+    X(hitBonus, 2.0)                                                           \
+    X(critBonus, 2.0)                                                          \
+    X(hasteBonus, 5.0)
+
+// Multiples of the correlation lengths, the fit picks the most likely. The
+// correlation lengths are the longest trusted.
+const double surrogateLengthScales[] = { 0.25, 0.5, 1.0 };
+// Smallest prior standard deviation of a build's DPS, relative to its mean
+const double surrogatePriorSpread = 0.1;
+
+void printParamArg(FILE *file, const char *name, double val) {
+    fprintf(file, " %s=%.15g", name, val);
+}
+void printParamArg(FILE *file, const char *name, unsigned val) {
+    fprintf(file, " %s=%u", name, val);
+}
+void printParamArg(FILE *file, const char *name, bool val) {
+    fprintf(file, " %s=%u", name, unsigned(val));
+}
+
+struct SurrogateResult {
+    Params params;
+    double dps = 0.0;
+    double stdError = 0.0;
+};
+
+struct SurrogateModel {
+    std::vector<std::vector<double>> inputs;
+    double mean = 0.0;
+    double amplitude = 0.0;
+    double lengthScale = 1.0;
+    // Cholesky factor of the covariance of the results, and its inverse
+    // times their residuals
+    std::vector<std::vector<double>> factor;
+    std::vector<double> weights;
+
+    static std::vector<double> getInputs(const Params &params) {
+        std::vector<double> out;
+        #define X(NAME, LENGTH) out.push_back(params.NAME / LENGTH);
+        SURROGATE_INPUT_LIST
+        #undef X
+        return out;
+    }
+
+    double getCovariance(const std::vector<double> &a, const std::vector<double> &b,
+                         double scale) const {
+        double d2 = 0.0;
+        for (size_t j = 0; j < a.size(); ++j) {
+            d2 += (a[j] - b[j]) * (a[j] - b[j]);
+        }
+        return amplitude * std::exp(-d2 / (2.0 * scale * scale));
+    }
+
+    void fit(const std::vector<const SurrogateResult *> &results) {
+        const size_t n = results.size();
+        if (n == 0)
+            return;
+        std::vector<double> y, noise;
+        for (const SurrogateResult *r : results) {
+            inputs.push_back(getInputs(r->params));
+            y.push_back(r->dps);
+            noise.push_back(std::max(r->stdError * r->stdError, 1e-6));
+        }
+
+        double sumWeights = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            mean += y[i] / noise[i];
+            sumWeights += 1.0 / noise[i];
+        }
+        mean /= sumWeights;
+
+        std::vector<double> residuals(n);
+        double sumSquares = 0.0;
+        double sumNoise = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            residuals[i] = y[i] - mean;
+            sumSquares += residuals[i] * residuals[i];
+            sumNoise += noise[i];
+        }
+        amplitude = std::max(std::max(sumSquares, sumNoise) / n,
+                             surrogatePriorSpread * surrogatePriorSpread * mean * mean);
+
+        double bestLikelihood = -INFINITY;
+        for (double scale : surrogateLengthScales) {
+            std::vector<std::vector<double>> cov(n, std::vector<double>(n));
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j <= i; ++j) {
+                    cov[i][j] = cov[j][i] = getCovariance(inputs[i], inputs[j], scale);
+                }
+                cov[i][i] += noise[i] + 1e-9 * amplitude;
+            }
+            if (!choleskyDecompose(cov))
+                continue;
+            std::vector<double> w = solveUpper(cov, solveLower(cov, residuals));
+            double likelihood = 0.0;
+            for (size_t i = 0; i < n; ++i) {
+                // Parenthesized, or the log() macro would take the call
+                likelihood -= 0.5 * residuals[i] * w[i] + (std::log)(cov[i][i]);
+            }
+            if (likelihood > bestLikelihood) {
+                bestLikelihood = likelihood;
+                lengthScale = scale;
+                factor = std::move(cov);
+                weights = std::move(w);
+            }
+        }
+    }
+
+    void predict(const Params &params, double &dps, double &error) const {
+        if (weights.empty()) {
+            dps = NAN;
+            error = INFINITY;
+            return;
+        }
+        std::vector<double> x = getInputs(params);
+        double nearest = INFINITY;
+        for (const std::vector<double> &input : inputs) {
+            double d2 = 0.0;
+            for (size_t j = 0; j < x.size(); ++j) {
+                d2 += (x[j] - input[j]) * (x[j] - input[j]);
+            }
+            nearest = std::min(nearest, std::sqrt(d2));
+        }
+        if (nearest > lengthScale || getHullDistance(inputs, x) > 1e-6) {
+            dps = NAN;
+            error = INFINITY;
+            return;
+        }
+        std::vector<double> cov(inputs.size());
+        dps = mean;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            cov[i] = getCovariance(x, inputs[i], lengthScale);
+            dps += cov[i] * weights[i];
+        }
+        std::vector<double> v = solveLower(factor, cov);
+        double variance = amplitude;
+        for (double val : v) {
+            variance -= val * val;
+        }
+        error = std::sqrt(std::max(variance, 0.0));
+    }
+};
+
+struct Surrogate {
+    const std::string filename;
+    std::mutex mutex;
+    std::vector<SurrogateResult> results;
+    // Fitted when first asked for, by build
+    std::map<std::string, std::unique_ptr<SurrogateModel>> models;
+
+    explicit Surrogate(StrView filename) : filename(filename) {
+        load();
+    }
+
+    static std::string getBuildKey(Params params) {
+        #define X(NAME, LENGTH) params.NAME = 0;
+        SURROGATE_INPUT_LIST
+        #undef X
+        std::string key;
+        #define X(NAME, TYPE, VALUE) appendKey(key, params.NAME);
+        PARAM_LIST
+        #undef X
+        return key;
+    }
+
+    // A missing file is an empty one
+    void load() {
+        FILE *file = ::fopen(filename.c_str(), "r");
+        if (!file) {
+            if (errno == ENOENT)
+                return;
+            fatal() << "Failed to open '" << filename << "': " << strerror(errno) << "\n";
+        }
+        char line[4096];
+        unsigned lineNum = 0;
+        while (::fgets(line, sizeof(line), file)) {
+            ++lineNum;
+            std::vector<StrView> tokens;
+            for (char *tok = ::strtok(line, " \t\r\n"); tok; tok = ::strtok(nullptr, " \t\r\n")) {
+                if (tok[0] == '#')
+                    break;
+                tokens.push_back(tok);
+            }
+            if (tokens.empty())
+                continue;
+            std::string where = filename + ":" + std::to_string(lineNum) + ": ";
+            SurrogateResult result;
+            if (tokens.size() < 2 || !parseVal(tokens[0], result.dps) ||
+                !parseVal(tokens[1], result.stdError)) {
+                fatal() << where << "Expected 'DPS STDERR NAME=VALUE...'\n";
+            }
+            for (size_t i = 2; i < tokens.size(); ++i) {
+                auto eq = tokens[i].find('=');
+                if (eq == StrView::npos ||
+                    !setParam(result.params, tokens[i].substr(0, eq), tokens[i].substr(eq + 1))) {
+                    fatal() << where << "Invalid param '" << tokens[i] << "'\n";
+                }
+            }
+            results.push_back(result);
+        }
+        ::fclose(file);
+    }
+
+    // 'numResults' is how many results of the build the model has
+    void predict(const Params &params, double &mean, double &error, size_t &numResults) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string key = getBuildKey(params);
+        std::unique_ptr<SurrogateModel> &model = models[key];
+        if (!model) {
+            std::vector<const SurrogateResult *> build;
+            for (const SurrogateResult &r : results) {
+                if (getBuildKey(r.params) == key) {
+                    build.push_back(&r);
+                }
+            }
+            model.reset(new SurrogateModel);
+            model->fit(build);
+        }
+        model->predict(params, mean, error);
+        numResults = model->inputs.size();
+    }
+
+    void add(const Params &params, const Estimate &est) {
+        std::lock_guard<std::mutex> lock(mutex);
+        SurrogateResult result;
+        result.params = params;
+        result.dps = est.mean;
+        result.stdError = est.stdError;
+        results.push_back(result);
+        models.erase(getBuildKey(params));
+
+        FILE *file = ::fopen(filename.c_str(), "a");
+        if (!file) {
+            fatal() << "Failed to open '" << filename << "': " << strerror(errno) << "\n";
+        }
+        fprintf(file, "%.4f %.4f", est.mean, est.stdError);
+        const Params defaults;
+        #define X(NAME, TYPE, VALUE)                        \
+        if (params.NAME != defaults.NAME) {                 \
+            printParamArg(file, #NAME, params.NAME);        \
+        }
+        PARAM_LIST
+        #undef X
+        fprintf(file, "\n");
+        ::fclose(file);
+    }
+};
+
+// Server //////////////////////////////////////////////////////////////////////
+// 'dps --serve=PATH' answers queries on a Unix domain socket, one per line:
+//     ID NAME=VALUE...
+// The names are params, or seed, duration (hours, may be fractional),
+// replicas, antithetic and controlVariates. They all default to the values
+// given on the command line. Any number of queries can be sent at once. Each one is answered as
+// soon as it finishes, in any order, with
+//     ID DPS STDERR VARIANCE_REDUCTION
+// (STDERR and VARIANCE_REDUCTION are 'none' with a single replica) or
+// 'ID error MESSAGE'. Identical queries in flight at the same time are
+// only simulated once. With --surrogate, queries the surrogate is confident
+// about are answered at once with
+//     ID DPS PREDICTED_ERROR surrogate
+// and the results of the others with at least two replicas are added to it.
+
+struct Connection {
+    const int fd;
+    std::mutex writeMutex;
+
+    explicit Connection(int fd) : fd(fd) { }
+    ~Connection() {
+        ::close(fd);
+    }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    // Gives up quietly if the client has gone
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        const char *ptr = line.data();
+        size_t left = line.size();
+        while (left) {
+            ssize_t n = ::send(fd, ptr, left, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            ptr += n;
+            left -= size_t(n);
+        }
+    }
+};
+
+struct Server {
+    // What a query gets for anything it doesn't set
+    struct Defaults {
+        Params params;
+        unsigned seed = 0;
+        double durationHours = 100.0;
+        unsigned numReplicas = 1;
+        bool antithetic = false;
+        bool controlVariates = false;
+    };
+
+    ThreadPool &pool;
+    const Defaults defaults;
+    Surrogate *const surrogate;
+    const double surrogateTolerance;
+
+    struct Query {
+        std::unique_ptr<Config> config;
+        std::unique_ptr<SimJob> job;
+        bool antithetic = false;
+        bool controlVariates = false;
+        // Everyone who asked, and the ids they asked with
+        std::vector<std::pair<std::shared_ptr<Connection>, std::string>> waiters;
+    };
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<Query>> inFlight;
+
+    Server(ThreadPool &pool, const Defaults &defaults, Surrogate *surrogate,
+           double surrogateTolerance) :
+        pool(pool), defaults(defaults), surrogate(surrogate),
+        surrogateTolerance(surrogateTolerance) { }
+
+    void finish(const std::string &key) {
+        std::unique_ptr<Query> query;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = inFlight.find(key);
+            assert(it != inFlight.end());
+            query = std::move(it->second);
+            inFlight.erase(it);
+        }
+        Estimate est = estimateDPS(query->job->results, query->antithetic,
+                                   query->controlVariates);
+        if (surrogate && std::isfinite(est.stdError)) {
+            surrogate->add(query->config->p, est);
+        }
+        char buf[128];
+        auto format = [](double val) {
+            char str[32];
+            if (std::isfinite(val)) {
+                snprintf(str, sizeof(str), "%.4f", val);
+            } else {
+                snprintf(str, sizeof(str), "none");
+            }
+            return std::string(str);
+        };
+        snprintf(buf, sizeof(buf), " %.4f %s %s\n", est.mean,
+                 format(est.stdError).c_str(), format(est.varianceReduction).c_str());
+        for (auto &waiter : query->waiters) {
+            waiter.first->send(waiter.second + buf);
+        }
+    }
+
+    void handleLine(const std::shared_ptr<Connection> &conn, std::string line) {
+        std::vector<StrView> tokens;
+        // Connections are served concurrently, so strtok's state can't be shared
+        char *save = nullptr;
+        for (char *tok = ::strtok_r(&line[0], " \t\r", &save); tok;
+             tok = ::strtok_r(nullptr, " \t\r", &save)) {
+            tokens.push_back(tok);
+        }
+        if (tokens.empty())
+            return;
+        std::string id = tokens[0];
+        auto reply = [&](const std::string &msg) {
+            conn->send(id + " error " + msg + "\n");
+        };
+
+        Params params = defaults.params;
+        unsigned seed = defaults.seed;
+        double durationHours = defaults.durationHours;
+        unsigned numReplicas = defaults.numReplicas;
+        bool antithetic = defaults.antithetic;
+        bool controlVariates = defaults.controlVariates;
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            auto eq = tokens[i].find('=');
+            if (eq == StrView::npos)
+                return reply("expected NAME=VALUE, got '" + tokens[i].str() + "'");
+            StrView name = tokens[i].substr(0, eq);
+            StrView valStr = tokens[i].substr(eq + 1);
+            bool valid;
+            if (name == "seed") {
+                valid = parseVal(valStr, seed);
+            } else if (name == "duration") {
+                valid = parseVal(valStr, durationHours) && durationHours > 0.0;
+            } else if (name == "replicas") {
+                valid = parseVal(valStr, numReplicas) && numReplicas > 0;
+            } else if (name == "antithetic") {
+                valid = parseVal(valStr, antithetic);
+            } else if (name == "controlVariates") {
+                valid = parseVal(valStr, controlVariates);
+            } else {
+                valid = setParam(params, name, valStr);
+            }
+            if (!valid)
+                return reply("invalid " + tokens[i].str());
+        }
+        if (antithetic && numReplicas % 2)
+            return reply("antithetic requires an even number of replicas");
+        std::string paramsError = params.getError();
+        if (!paramsError.empty())
+            return reply(paramsError);
+
+        if (surrogate) {
+            double mean, error;
+            size_t numResults;
+            surrogate->predict(params, mean, error, numResults);
+            if (error <= surrogateTolerance) {
+                char buf[128];
+                snprintf(buf, sizeof(buf), " %.4f %.4f surrogate\n", mean, error);
+                conn->send(id + buf);
+                return;
+            }
+        }
+
+        std::string key;
+        #define X(NAME, TYPE, VALUE) appendKey(key, params.NAME);
+        PARAM_LIST
+        #undef X
+        appendKey(key, seed);
+        appendKey(key, durationHours);
+        appendKey(key, numReplicas);
+        appendKey(key, antithetic);
+        appendKey(key, controlVariates);
+
+        SimJob *job = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::unique_ptr<Query> &query = inFlight[key];
+            if (query) {
+                query->waiters.emplace_back(conn, id);
+                return;
+            }
+            query.reset(new Query);
+            query->antithetic = antithetic;
+            query->controlVariates = controlVariates;
+            query->waiters.emplace_back(conn, id);
+            query->config.reset(new Config(params));
+            query->job.reset(SimJob::create(
+                getInstrumentation(RK_dps, controlVariates, false, false),
+                *query->config, seed, 0, 0, numReplicas, antithetic,
+                durationHours * 60 * 60 / numReplicas));
+            query->job->onDone = [this, key]() { finish(key); };
+            job = query->job.get();
+        }
+        job->submit(pool);
+    }
+
+    // Queries are started as soon as their line arrives. The connection
+    // stays open until the last of them is answered, so a client can close
+    // its end for writing and then read the answers.
+    void serveConnection(std::shared_ptr<Connection> conn) {
+        std::string buf;
+        char chunk[4096];
+        for (;;) {
+            ssize_t n = ::read(conn->fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            buf.append(chunk, size_t(n));
+            size_t start = 0;
+            for (size_t nl; (nl = buf.find('\n', start)) != std::string::npos; start = nl + 1) {
+                handleLine(conn, buf.substr(start, nl - start));
+            }
+            buf.erase(0, start);
+        }
+        if (!buf.empty()) {
+            handleLine(conn, buf);
+        }
+    }
+
+    void run(StrView path) {
+        std::string pathStr = path;
+        sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (pathStr.size() >= sizeof(addr.sun_path)) {
+            fatal() << "Socket path '" << path << "' is too long\n";
+        }
+        ::memcpy(addr.sun_path, pathStr.c_str(), pathStr.size() + 1);
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            fatal() << "Failed to create a socket: " << strerror(errno) << "\n";
+        }
+        ::unlink(pathStr.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(fd, 64) != 0) {
+            fatal() << "Failed to listen on '" << path << "': " << strerror(errno) << "\n";
+        }
+        for (;;) {
+            int connFd = ::accept(fd, nullptr, nullptr);
+            if (connFd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                fatal() << "Failed to accept a connection: " << strerror(errno) << "\n";
+            }
+            std::thread(&Server::serveConnection, this,
+                        std::make_shared<Connection>(connFd)).detach();
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    Params params;
+    unsigned durationHours = 100;
+
+    bool haveSeed = false;
+    unsigned seed = 0;
+
+    bool haveLog = false;
+    StrView logFilename;
+
+    StrView histogramsFilename;
+
+    StrView columnarFilename;
+
+    ResultKind resultKind = RK_dps;
+
+    unsigned numReplicas = 1;
+    bool haveReplicas = false;
+    bool antithetic = false;
+    bool controlVariates = false;
+
+    bool profile = false;
+
+    double progressInterval = 0.0;
+    StrView progressFilename;
+
+    unsigned numThreads = unsigned(ThreadPool::getDefaultNumThreads());
+
+    std::vector<SweepAxis> sweepAxes;
+    unsigned sweepPoints = 20;
+    double sweepTolerance = 0.0;
+
+    std::vector<SweepAxis> tuneAxes;
+
+    std::vector<SensitivityRange> sensitivityRanges;
+    unsigned sensitivitySamples = defaultSensitivitySamples;
+
+    StrView servePath;
+
+    StrView surrogateFilename;
+    double surrogateTolerance = 1.0;
+
+    StrView gearFilename;
+    unsigned gearCandidates = defaultGearCandidates;
+    unsigned gearTop = defaultGearTop;
+
+    Shard shard;
+    bool commonRandom = false;
+    std::vector<StrView> mergeFiles;
+
+    SweepAxis tmpAxis;
+    SensitivityRange tmpRange;
+    StrView tmpStr;
+
+    ArgParser argParser(argv + 1, argc - 1);
+    while (!argParser.finished()) {
+        if (argParser.consume('v', "verbose")) {
+            verbose = true;
+        } else if (argParser.consume("duration", durationHours)) {
+            // Pass
+        } else if (argParser.consume("seed", seed)) {
+            haveSeed = true;
+        } else if (argParser.consume("log", logFilename)) {
+            haveLog = true;
+        } else if (argParser.consume("histograms", histogramsFilename)) {
+            // Pass
+        } else if (argParser.consume("columnar", columnarFilename)) {
+            // Pass
+        } else if (argParser.consume("result", resultKind)) {
+            // Pass
+        } else if (argParser.consume("replicas", numReplicas)) {
+            haveReplicas = true;
+        } else if (argParser.consume("antithetic")) {
+            antithetic = true;
+        } else if (argParser.consume("control-variates")) {
+            controlVariates = true;
+        } else if (argParser.consume("profile")) {
+            profile = true;
+        } else if (argParser.consume("progress", progressInterval)) {
+            // Pass
+        } else if (argParser.consume("progress-file", progressFilename)) {
+            // Pass
+        } else if (argParser.consume('j', "threads", numThreads)) {
+            // Pass
+        } else if (argParser.consume("sweep", tmpAxis)) {
+            sweepAxes.push_back(tmpAxis);
+        } else if (argParser.consume("sweep-points", sweepPoints)) {
+            // Pass
+        } else if (argParser.consume("sweep-tolerance", sweepTolerance)) {
+            // Pass
+        } else if (argParser.consume("sensitivity", tmpRange)) {
+            sensitivityRanges.push_back(tmpRange);
+        } else if (argParser.consume("sensitivity-samples", sensitivitySamples)) {
+            // Pass
+        } else if (argParser.consume("serve", servePath)) {
+            // Pass
+        } else if (argParser.consume("surrogate", surrogateFilename)) {
+            // Pass
+        } else if (argParser.consume("surrogate-tolerance", surrogateTolerance)) {
+            // Pass
+        } else if (argParser.consume("gear", gearFilename)) {
+            // Pass
+        } else if (argParser.consume("gear-candidates", gearCandidates)) {
+            // Pass
+        } else if (argParser.consume("gear-top", gearTop)) {
+            // Pass
+        } else if (argParser.consume("tune", tmpStr)) {
+            if (tmpStr == "rotation") {
+                for (const char *axis : rotationTuneAxes) {
+                    parseVal(axis, tmpAxis);
+                    tuneAxes.push_back(tmpAxis);
+                }
+            } else if (parseVal(tmpStr, tmpAxis)) {
+                tuneAxes.push_back(tmpAxis);
+            } else {
+                fatal() << "Invalid value for argument --tune: '" << tmpStr << "'\n";
+            }
+        } else if (argParser.consume("common-random")) {
+            commonRandom = true;
+        } else if (argParser.consume("shard", shard)) {
+            // Pass
+        } else if (argParser.consume("merge", tmpStr)) {
+            mergeFiles.push_back(tmpStr);
+        } else if (argParser.peek().startswith("-")) {
+            fatal() << "Invalid argument '" << argParser.peek() << "'\n";
+        } else {
+            parseParamArg(params, argParser.consume());
+        }
+    }
+
+    std::string paramsError = params.getError();
+    if (!paramsError.empty()) {
+        fatal() << paramsError << "\n";
+    }
+
+    if (!haveSeed) {
+        seed = unsigned(std::chrono::system_clock::now().time_since_epoch().count());
+    }
+
+    if (haveLog) {
+        const char *str = logFilename.data();
+        assert(str[logFilename.size()] == '\0');
+        logFile = ::fopen(str, "w");
+    } else if (verbose) {
+        logFile = stderr;
+    }
+
+    log("Seed: %u\n", seed);
+    if (logFile) {
+        params.print(logFile);
+    }
+
+    if (numReplicas == 0) {
+        fatal() << "--replicas must be at least 1\n";
+    }
+    if (antithetic && numReplicas % 2) {
+        fatal() << "--antithetic requires an even number of replicas\n";
+    }
+
+    if (!histogramsFilename.empty() &&
+        (!mergeFiles.empty() || !sweepAxes.empty() || !tuneAxes.empty() ||
+         !gearFilename.empty() || !sensitivityRanges.empty())) {
+        fatal() << "--histograms can't be used with --merge, --sweep, --tune, --gear "
+                   "or --sensitivity\n";
+    }
+
+    // Sweeps and replicas write their results to a columnar file instead of
+    // stdout, row by row as they finish
+    std::unique_ptr<ColumnarWriter> columnar;
+    if (!columnarFilename.empty()) {
+        if ((sweepAxes.empty() && resultKind != RK_replicas) || !mergeFiles.empty() ||
+            !tuneAxes.empty() || !gearFilename.empty() || !sensitivityRanges.empty() ||
+            !servePath.empty() || !surrogateFilename.empty() || sweepTolerance != 0.0) {
+            fatal() << "--columnar only supports uniform sweeps and --result=replicas\n";
+        }
+        columnar.reset(new ColumnarWriter);
+    }
+
+    if (!mergeFiles.empty()) {
+        MergedReplicas merged;
+        for (StrView filename : mergeFiles) {
+            readReplicas(filename, merged);
+        }
+        merged.check();
+        if (haveReplicas && numReplicas != merged.run.numReplicas) {
+            fatal() << "The merged run has " << merged.run.numReplicas
+                    << " replicas, not " << numReplicas << "\n";
+        }
+        const std::vector<ReplicaResult> &replicas = merged.results;
+        if (resultKind == RK_replicas) {
+            printf("# run %s\n", merged.run.str().c_str());
+            for (unsigned i = 0; i < replicas.size(); ++i) {
+                replicas[i].print(stdout, i);
+            }
+            return 0;
+        }
+        if (needsFightStats(resultKind)) {
+            fatal() << "Merged replica results only support --result=dps, "
+                       "estimate or replicas\n";
+        }
+        emitResult(resultKind, estimateDPS(replicas, antithetic, controlVariates),
+                   nullptr);
+        return 0;
+    }
+
+    if (logFile) {
+        // Interleaved logs from several fights would be unreadable
+        numThreads = 1;
+    }
+
+    // Opened before the pool so they count the worker threads too
+    PerfCounters perf;
+
+    ThreadPool pool(numThreads);
+
+    // Reports every --progress seconds, to stderr or --progress-file (which
+    // may be a FIFO), and a last time when main returns
+    std::unique_ptr<Telemetry> progress;
+    if (progressInterval < 0.0) {
+        fatal() << "--progress must be a positive number of seconds\n";
+    }
+    if (progressInterval > 0.0) {
+        FILE *file = stderr;
+        if (!progressFilename.empty()) {
+            std::string path = progressFilename;
+            file = ::fopen(path.c_str(), "a");
+            if (!file) {
+                fatal() << "Failed to open '" << progressFilename << "'\n";
+            }
+        }
+        progress.reset(new Telemetry(pool.getNumThreads(), progressInterval, file));
+        telemetry = progress.get();
+    }
+
+    const Instrumentation instrumentation =
+        getInstrumentation(resultKind, controlVariates, profile,
+                           !histogramsFilename.empty());
+
+    // The total duration is shared between the replicas
+    double replicaDuration = double(durationHours) * 60 * 60 / numReplicas;
+
+    std::unique_ptr<Surrogate> surrogate;
+    if (!surrogateFilename.empty()) {
+        if ((resultKind != RK_dps && resultKind != RK_estimate) ||
+            !sweepAxes.empty() || !tuneAxes.empty() || !gearFilename.empty() ||
+            !sensitivityRanges.empty() || !histogramsFilename.empty() ||
+            shard.count > 1) {
+            fatal() << "--surrogate only supports --result=dps or estimate, without "
+                       "--sweep, --tune, --gear, --sensitivity, --histograms or "
+                       "--shard\n";
+        }
+        surrogate.reset(new Surrogate(surrogateFilename));
+    }
+
+    if (!servePath.empty()) {
+        if (!sweepAxes.empty() || !tuneAxes.empty() || !gearFilename.empty() ||
+            !sensitivityRanges.empty() || !histogramsFilename.empty() ||
+            shard.count > 1) {
+            fatal() << "--serve takes its queries from the socket\n";
+        }
+        Server::Defaults defaults;
+        defaults.params = params;
+        defaults.seed = seed;
+        defaults.durationHours = durationHours;
+        defaults.numReplicas = numReplicas;
+        defaults.antithetic = antithetic;
+        defaults.controlVariates = controlVariates;
+        Server server(pool, defaults, surrogate.get(), surrogateTolerance);
+        server.run(servePath);
+        return 0;
+    }
+
+    if (!sensitivityRanges.empty()) {
+        if (resultKind != RK_dps || !sweepAxes.empty() || !tuneAxes.empty() ||
+            !gearFilename.empty() || shard.count > 1) {
+            fatal() << "--sensitivity only supports --result=dps, without --sweep, "
+                       "--tune, --gear or --shard\n";
+        }
+        if (sensitivitySamples < 2) {
+            fatal() << "--sensitivity-samples must be at least 2\n";
+        }
+        SensitivityAnalysis analysis(params, sensitivityRanges, pool, instrumentation,
+                                     seed, numReplicas, antithetic, controlVariates,
+                                     replicaDuration, sensitivitySamples);
+        analysis.run();
+        analysis.print(stdout);
+        if (profile) {
+            fprintf(stderr, "Profile:\n");
+            fprintf(stderr, "    Runs: %zu\n", analysis.numRuns);
+        }
+        return 0;
+    }
+
+    if (!gearFilename.empty()) {
+        if (resultKind != RK_dps || !sweepAxes.empty() || !tuneAxes.empty() ||
+            shard.count > 1) {
+            fatal() << "--gear only supports --result=dps, without --sweep, "
+                       "--tune or --shard\n";
+        }
+        if (gearCandidates == 0) {
+            fatal() << "--gear-candidates must be at least 1\n";
+        }
+        GearDB db;
+        db.load(gearFilename);
+        GearOptimizer optimizer(params, db, pool, instrumentation, seed,
+                                numReplicas, antithetic, controlVariates,
+                                replicaDuration, gearCandidates);
+        optimizer.print(stdout, gearTop);
+        if (profile) {
+            fprintf(stderr, "Profile:\n");
+            fprintf(stderr, "    Items: %zu, %zu pruned as dominated\n",
+                    db.items.size(), optimizer.numPruned);
+            fprintf(stderr, "    Weapon sets: %zu\n", optimizer.weaponSets.size());
+            fprintf(stderr, "    Branches searched: %zu\n", optimizer.numBranches);
+        }
+        return 0;
+    }
+
+    if (!tuneAxes.empty()) {
+        if (resultKind != RK_dps || !sweepAxes.empty() || shard.count > 1) {
+            fatal() << "--tune only supports --result=dps, without --sweep or --shard\n";
+        }
+        if (numReplicas / (antithetic ? 2 : 1) < 2) {
+            fatal() << "--tune needs at least two replicas (pairs with --antithetic)\n";
+        }
+        Tuner tuner(params, tuneAxes, pool, instrumentation, seed, numReplicas,
+                    antithetic, controlVariates, replicaDuration);
+        tuner.print(stdout);
+        return 0;
+    }
+
+    if (!sweepAxes.empty()) {
+        if (resultKind != RK_dps) {
+            fatal() << "Sweeps only support --result=dps\n";
+        }
+        if (sweepPoints == 0) {
+            fatal() << "--sweep-points must be at least 1\n";
+        }
+
+        if (sweepTolerance != 0.0) {
+            if (!(sweepTolerance > 0.0)) {
+                fatal() << "--sweep-tolerance must be positive\n";
+            }
+            if (numReplicas / (antithetic ? 2 : 1) < 2) {
+                fatal() << "--sweep-tolerance needs at least two replicas "
+                           "(pairs with --antithetic)\n";
+            }
+            for (const SweepAxis &axis : sweepAxes) {
+                Params end = params;
+                if (!offsetParam(end, axis.name, axis.step * (sweepPoints - 1))) {
+                    fatal() << "Sweep " << axis.label << " is out of range\n";
+                }
+            }
+            AdaptiveSweep sweep(params, sweepAxes, pool, instrumentation, seed,
+                                numReplicas, antithetic, controlVariates,
+                                replicaDuration, commonRandom, sweepTolerance,
+                                sweepPoints);
+            sweep.run();
+            sweep.warnUnmet(stderr);
+            sweep.print(stdout);
+            if (profile) {
+                fprintf(stderr, "Profile:\n");
+                for (size_t i = 0; i < sweepAxes.size(); ++i) {
+                    fprintf(stderr, "    Sweep %s: %zu points\n",
+                            sweepAxes[i].label.str().c_str(), sweep.points[i].size());
+                }
+                fprintf(stderr, "    Runs: %zu\n", sweep.numJobs);
+            }
+            return 0;
+        }
+
+        // One row per axis and point, the base point in each axis. Each
+        // axis has a 'NAME\tLABEL' line in the labels, so its x can be
+        // labelled with the param.
+        if (columnar) {
+            std::string labels;
+            for (const SweepAxis &axis : sweepAxes) {
+                labels += axis.name.str() + "\t" + axis.label.str() + "\n";
+            }
+            if (!columnar->create(columnarFilename,
+                                  { { "axis", "u4" }, { "point", "u4" }, { "x", "f8" },
+                                    { "dps", "f8" }, { "stdError", "f8" } },
+                                  sweepAxes.size() * sweepPoints, labels)) {
+                fatal() << "Failed to create '" << columnarFilename << "'\n";
+            }
+        }
+
+        // The base point is shared by all the axes
+        std::vector<std::unique_ptr<Config>> configs;
+        std::vector<std::unique_ptr<SimJob>> jobs;
+        auto addPoint = [&](const Params &pointParams, size_t firstAxis, size_t lastAxis,
+                            unsigned point) {
+            // Every point gets its own streams unless they're asked to share
+            unsigned configId = commonRandom ? 0 : unsigned(jobs.size());
+            configs.emplace_back(new Config(pointParams));
+            jobs.emplace_back(SimJob::create(instrumentation, *configs.back(),
+                                             seed, configId, 0, numReplicas,
+                                             antithetic, replicaDuration));
+            SimJob *job = jobs.back().get();
+            if (columnar) {
+                ColumnarWriter *writer = columnar.get();
+                job->onDone = [&, job, point, firstAxis, lastAxis, writer]() {
+                    Estimate est = estimateDPS(job->results, antithetic, controlVariates);
+                    for (size_t a = firstAxis; a < lastAxis; ++a) {
+                        uint64_t row = a * sweepPoints + point;
+                        double x = getParamVal(job->config.p, sweepAxes[a].name);
+                        if (!writer->set(row, 0, uint32_t(a)) ||
+                            !writer->set(row, 1, uint32_t(point)) ||
+                            !writer->set(row, 2, x) || !writer->set(row, 3, est.mean) ||
+                            !writer->set(row, 4, est.stdError)) {
+                            fatal() << "Failed to write to '" << columnarFilename << "'\n";
+                        }
+                    }
+                };
+            }
+            job->submit(pool);
+        };
+        addPoint(params, 0, sweepAxes.size(), 0);
+        for (size_t a = 0; a < sweepAxes.size(); ++a) {
+            const SweepAxis &axis = sweepAxes[a];
+            for (unsigned i = 1; i < sweepPoints; ++i) {
+                Params pointParams = params;
+                if (!offsetParam(pointParams, axis.name, axis.step * i)) {
+                    fatal() << "Sweep " << axis.label << " is out of range\n";
+                }
+                addPoint(pointParams, a, a + 1, i);
+            }
+        }
+        pool.wait();
+        if (columnar)
+            return 0;
+
+        printf("x");
+        for (unsigned i = 0; i < sweepPoints; ++i) {
+            printf(",%u", i);
+        }
+        printf("\n");
+        size_t jobIdx = 1;
+        for (const SweepAxis &axis : sweepAxes) {
+            Estimate base = estimateDPS(jobs[0]->results, antithetic, controlVariates);
+            printf("%s,%.2f", axis.label.str().c_str(), base.mean);
+            for (unsigned i = 1; i < sweepPoints; ++i) {
+                const SimJob &job = *jobs[jobIdx++];
+                Estimate est = estimateDPS(job.results, antithetic, controlVariates);
+                printf(",%.2f", est.mean);
+            }
+            printf("\n");
+        }
+        return 0;
+    }
+
+    if (surrogate) {
+        if (numReplicas / (antithetic ? 2 : 1) < 2) {
+            fatal() << "--surrogate needs at least two replicas (pairs with "
+                       "--antithetic) for the error of its results\n";
+        }
+        auto predictStart = std::chrono::steady_clock::now();
+        double mean, error;
+        size_t numResults;
+        surrogate->predict(params, mean, error, numResults);
+        std::chrono::duration<double> predictTime =
+            std::chrono::steady_clock::now() - predictStart;
+        if (profile) {
+            fprintf(stderr, "Surrogate: %.2f +- %.2f from %zu results in %.0fus\n",
+                    mean, error, numResults, predictTime.count() * 1e6);
+        }
+        if (error <= surrogateTolerance) {
+            Estimate est;
+            est.mean = mean;
+            est.stdError = error;
+            est.varianceReduction = NAN;
+            emitResult(resultKind, est, nullptr);
+            return 0;
+        }
+    }
+
+    const Config config(params);
+
+    // Shards split the replicas into contiguous blocks, keeping antithetic
+    // pairs together
+    const unsigned group = antithetic ? 2 : 1;
+    const unsigned numGroups = numReplicas / group;
+    unsigned firstReplica = group * unsigned(uint64_t(numGroups) * shard.idx / shard.count);
+    unsigned lastReplica = group * unsigned(uint64_t(numGroups) * (shard.idx + 1) / shard.count);
+    if (shard.count > 1 && resultKind != RK_replicas) {
+        fatal() << "--shard requires --result=replicas\n";
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    if (profile) {
+        perf.start();
+    }
+
+    std::unique_ptr<SimJob> job(SimJob::create(instrumentation, config, seed, 0,
+                                               firstReplica,
+                                               lastReplica - firstReplica,
+                                               antithetic, replicaDuration));
+    const ReplicaRun replicaRun(params, seed, numReplicas, durationHours, antithetic);
+    if (columnar) {
+        if (!columnar->create(columnarFilename, getReplicaColumns(),
+                              lastReplica - firstReplica, replicaRun.str() + "\n")) {
+            fatal() << "Failed to create '" << columnarFilename << "'\n";
+        }
+        ColumnarWriter *writer = columnar.get();
+        SimJob *jobPtr = job.get();
+        job->onReplica = [writer, jobPtr](unsigned i) {
+            writeReplica(*writer, i, jobPtr->firstReplica + i, jobPtr->results[i]);
+        };
+    }
+    if (telemetry) {
+        telemetry->showEstimate = true;
+    }
+    job->submit(pool);
+    pool.wait();
+    size_t numEvents = job->numEvents.load();
+    const std::vector<ReplicaResult> &replicas = job->results;
+
+    if (profile) {
+        perf.stop();
+        std::chrono::duration<double> wallTime =
+            std::chrono::steady_clock::now() - startTime;
+        fprintf(stderr, "Profile:\n");
+        fprintf(stderr, "    Config: %zu bytes (shared)\n", sizeof(Config));
+        fprintf(stderr, "    DPS: %zu bytes per instance, %s instrumentation\n",
+                job->getFightSize(), getInstrumentationName(instrumentation));
+        fprintf(stderr, "    Events: %zu (%.0f per second)\n",
+                numEvents, numEvents / wallTime.count());
+        size_t numEvaluations = job->numEvaluations.load();
+        size_t numIdleEvaluations = job->numIdleEvaluations.load();
+        fprintf(stderr, "    Rotation evaluations: %zu (%.1f%% of events), "
+                "%zu idle, %zu skipped\n",
+                numEvaluations, 100.0 * numEvaluations / std::max<size_t>(numEvents, 1),
+                numIdleEvaluations, numEvents - numEvaluations);
+        uint64_t numDraws = job->numDraws.load();
+        fprintf(stderr, "    Random draws: %llu (%.3f per event)\n",
+                (unsigned long long)numDraws, double(numDraws) / std::max<size_t>(numEvents, 1));
+        fprintf(stderr, "    Wall time: %.3fs\n", wallTime.count());
+        perf.print(stderr, numEvents, "event");
+    }
+
+    FightStats totals = job->getTotals();
+    if (!histogramsFilename.empty()) {
+        const char *str = histogramsFilename.data();
+        assert(str[histogramsFilename.size()] == '\0');
+        FILE *file = ::fopen(str, "w");
+        if (!file) {
+            fatal() << "Failed to open '" << histogramsFilename << "'\n";
+        }
+        job->getHistograms().print(file);
+        ::fclose(file);
+    }
+
+    if (resultKind == RK_replicas) {
+        if (columnar)
+            return 0;
+        printf("# run %s\n", replicaRun.str().c_str());
+        for (unsigned i = 0; i < replicas.size(); ++i) {
+            replicas[i].print(stdout, firstReplica + i);
+        }
+        return 0;
+    }
+
+    Estimate est = estimateDPS(replicas, antithetic, controlVariates);
+    log("DPS: %.2f +- %.2f, variance reduction %.2f (%zu samples, %zu controls)\n",
+        est.mean, est.stdError, est.varianceReduction,
+        est.samples, est.controls);
+
+    if (surrogate) {
+        surrogate->add(params, est);
     }
 
-    emitResult(resultKind, dps);
+    emitResult(resultKind, est, &totals);
 }
@@ -2,6 +2,7 @@
 
 import argparse
 import os
+import socket
 import sys
 import subprocess
 
@@ -198,6 +199,30 @@ def add(*params_list):
                 result[k] = v
     return result
 
+all_runs = [
+    Run("2h-no-talents", merge(th, gear)),
+    Run("2h-arms", merge(th, gear, th_arms)),
+    Run("2h-arms-prot", merge(th, gear, th_arms_prot)),
+    Run("2h-fury", merge(th, gear, th_fury)),
+    Run("2h-fury-prot", merge(th, gear, th_fury_prot)),
+    Run("2h-arms-fury", merge(th, gear, th_arms_fury)),
+
+    Run("dw-no-talents", merge(dw, gear)),
+    Run("dw-arms", merge(dw, gear, dw_arms)),
+    Run("dw-arms-prot", merge(dw, gear, dw_arms_prot)),
+    Run("dw-fury", merge(dw, gear, dw_fury)),
+    Run("dw-fury-prot", merge(dw, gear, dw_fury_prot)),
+    Run("dw-arms-fury", merge(dw, gear, dw_arms_fury)),
+]
+
+# Runs done by the runner script
+default_runs = [
+    "2h-arms",
+    "2h-arms-prot",
+    "2h-fury",
+    "dw-fury",
+]
+
 def fatal(msg):
     sys.stderr.write(msg + "\n")
     sys.exit(1)
@@ -211,13 +236,16 @@ def run_capture(cmd):
         fatal("Command exited with status {0}".format(exit_code))
     return out_text.decode("utf-8").strip()
 
-def run_params(params, log=None):
+def run_params(params, log=None, extra=[]):
     cmd = [ args.bin ]
     cmd.append("--duration={}".format(args.duration))
     if args.verbose:
         cmd.append("--verbose")
     if log:
         cmd.append("--log={}".format(log))
+    if args.progress:
+        cmd.append("--progress={}".format(args.progress))
+    cmd.extend(extra)
 
     for k, v in params.items():
         cmd.append("{}={}".format(k, v))
@@ -230,34 +258,115 @@ def quick_run(run):
     if args.log:
         log_file = "{}.txt".format(run.name)
 
-    dps = run_params(run.params, log=log_file)
+    extra = []
+    if args.surrogate:
+        # Answered from earlier results when they're close enough
+        extra = [
+            "--surrogate={}".format(args.surrogate),
+            "--replicas={}".format(args.replicas),
+        ]
+    dps = run_params(run.params, log=log_file, extra=extra)
     print(dps)
 
+# Send every run to a 'dps --serve' daemon at once and print the answers
+# as they arrive
+def server_runs(runs):
+    names = { str(i) : run.name for i, run in enumerate(runs) }
+    lines = []
+    for i, run in enumerate(runs):
+        fields = [ str(i), "duration={}".format(args.duration) ]
+        for k, v in run.params.items():
+            fields.append("{}={}".format(k, v))
+        lines.append(" ".join(fields) + "\n")
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(args.server)
+        sock.sendall("".join(lines).encode("utf-8"))
+        sock.shutdown(socket.SHUT_WR)
+        with sock.makefile("r") as f:
+            for line in f:
+                fields = line.split()
+                print("Run: {}: {}".format(names[fields[0]], " ".join(fields[1:])))
+
 def full_run(run):
     print("Run: " + run.name)
 
-    log_file = None
+    # Only the base point is logged: the sweep's points would all go to the
+    # one file, and logging makes dps run on a single thread
     if args.log:
-        log_file = "{}.txt".format(run.name)
-
-    base  = run_params(run.params, log=log_file)
-    rows = [
-        ["x", "0"],
-        ["hit"],
-        ["crit"],
-        ["*10 str"],
+        run_params(run.params, log="{}.txt".format(run.name))
+
+    # The sweep points run in parallel inside a single dps process
+    extra = [
+        "--sweep=hitBonus:1:hit",
+        "--sweep=critBonus:1:crit",
+        "--sweep=strength:10:*10 str",
+        "--sweep-points=20",
+        # Same random streams at every point, for smoother curves
+        "--common-random",
     ]
-    for row in rows[1:]:
-        row.append(base)
-    for i in range(1,20):
-        rows[0].append(str(i))
-        rows[1].append(run_params(add(run.params, {"hitBonus" : i})))
-        rows[2].append(run_params(add(run.params, {"critBonus" : i})))
-        rows[3].append(run_params(add(run.params, {"strength" : i * 10})))
-
-    with open("{}.csv".format(run.name), "w") as f:
-        for row in rows:
-            f.write(",".join(row) + "\n")
+    if args.tolerance:
+        # Refine where the curves bend instead of running every point
+        extra += [
+            "--sweep-tolerance={}".format(args.tolerance),
+            "--replicas={}".format(args.replicas),
+        ]
+        csv = run_params(run.params, extra=extra)
+        with open("{}.csv".format(run.name), "w") as f:
+            f.write(csv + "\n")
+        return
+
+    # Filled in as the points finish, for 'plot.py' to map ('plot.py --csv'
+    # converts it)
+    extra.append("--columnar={}.dpsc".format(run.name))
+    run_params(run.params, extra=extra)
+
+# Ranges of the sensitivity analysis, as offsets from a run's params for
+# stats and absolute for the rest
+sensitivity_offsets = {
+    "strength": (-50, 50),
+    "agility": (-50, 50),
+    "bonusAttackPower": (-100, 100),
+    "hitBonus": (-4, 6),
+    "critBonus": (-4, 6),
+    "hasteBonus": (0, 10),
+}
+sensitivity_ranges = {
+    "whirlwindMinRage": (40, 100),
+    "whirlwindOverpowerMargin": (0, 30),
+    "overpowerStanceHold": (0, 3),
+    "stanceCDDuration": (1, 2),
+    "overpowerProcDuration": (4, 6),
+}
+
+def sensitivity_run(run):
+    print("Run: " + run.name)
+
+    extra = [ "--replicas={}".format(args.replicas) ]
+    for k, (low, high) in sensitivity_offsets.items():
+        base = float(run.params.get(k, 0))
+        extra.append("--sensitivity={}:{}:{}".format(k, max(base + low, 0), base + high))
+    for k, (low, high) in sensitivity_ranges.items():
+        extra.append("--sensitivity={}:{}:{}".format(k, low, high))
+    csv = run_params(run.params, extra=extra)
+
+    with open("{}-sensitivity.csv".format(run.name), "w") as f:
+        f.write(csv + "\n")
+    print(csv)
+
+# Params that come from the item database when optimizing gear
+gear_params = set(th) | set(dw) | set(gear)
+
+def gear_run(run):
+    print("Run: " + run.name)
+
+    # Only the talents, the items provide the rest
+    params = { k : v for k, v in run.params.items() if k not in gear_params }
+    csv = run_params(params, extra=[
+        "--gear={}".format(args.gear),
+        "--replicas={}".format(args.replicas),
+    ])
+    print(csv)
 
 def main():
     parser = argparse.ArgumentParser(description="dps runner script")
@@ -266,32 +375,45 @@ def main():
     parser.add_argument("-q", "--quick", action="store_true")
     parser.add_argument("--duration", default="100")
     parser.add_argument("--bin", default=dps)
+    parser.add_argument("--gear", metavar="ITEMS",
+                        help="Find the best gear from an item database")
+    parser.add_argument("--replicas", default="20")
+    parser.add_argument("--progress", metavar="SECONDS",
+                        help="Report the progress of each run to stderr")
+    parser.add_argument("--tolerance", metavar="DPS",
+                        help="Adaptive sweeps to this error instead of uniform ones")
+    parser.add_argument("--surrogate", metavar="FILE",
+                        help="Reuse the results kept in FILE for quick runs")
+    parser.add_argument("--sensitivity", action="store_true",
+                        help="Rank the params by how much of the DPS they explain")
+    parser.add_argument("--server", metavar="SOCKET",
+                        help="Do quick runs on a 'dps --serve' daemon")
+    parser.add_argument("--targets", metavar="N",
+                        help="Fight N enemies at once, for cleave and trash packs")
     #parser.add_argument("modes", nargs="+")
 
     global args
     args = parser.parse_args()
 
-    runs = [
-        #Run("2h-no-talents", merge(th, gear)),
-        Run("2h-arms", merge(th, gear, th_arms)),
-        Run("2h-arms-prot", merge(th, gear, th_arms_prot)),
-        Run("2h-fury", merge(th, gear, th_fury)),
-        #Run("2h-fury-prot", merge(th, gear, th_fury_prot)),
-        #Run("2h-arms-fury", merge(th, gear, th_arms_fury)),
-
-        #Run("dw-no-talents", merge(dw, gear)),
-        #Run("dw-arms", merge(dw, gear, dw_arms)),
-        #Run("dw-arms-prot", merge(dw, gear, dw_arms_prot)),
-        Run("dw-fury", merge(dw, gear, dw_fury)),
-        #Run("dw-fury-prot", merge(dw, gear, dw_fury_prot)),
-        #Run("dw-arms-fury", merge(dw, gear, dw_arms_fury)),
-    ]
+    runs = [run for run in all_runs if run.name in default_runs]
+    if args.targets:
+        runs = [Run(run.name, merge(run.params, { "numTargets": args.targets }))
+                for run in runs]
 
-    if args.quick:
+    if args.gear:
+        for run in runs:
+            gear_run(run)
+    elif args.sensitivity:
+        for run in runs:
+            sensitivity_run(run)
+    elif args.quick and args.server:
+        server_runs(runs)
+    elif args.quick:
         for run in runs:
             quick_run(run)
     else:
         for run in runs:
             full_run(run)
 
-main()
+if __name__ == "__main__":
+    main()
@@ -2,31 +2,185 @@
 
 import argparse
 import csv
+import sys
 import matplotlib.pyplot as plt
+import numpy as np
+
+histogram_header = ["histogram", "low", "high", "count"]
+adaptive_sweep_header = ["axis", "x", "dps", "stdError", "kind"]
+
+# Files written by 'dps --columnar', laid out as in Columnar.h
+columnar_magic = b"DPSC"
+columnar_header = np.dtype([
+    ("magic", "S4"),
+    ("version", "=u4"),
+    ("byteOrder", "=u4"),
+    ("numColumns", "=u4"),
+    ("numRows", "=u8"),
+    ("dataOffset", "=u8"),
+    ("labelsSize", "=u8"),
+])
+columnar_column = np.dtype([("name", "S24"), ("type", "S8")])
+
+def is_columnar(filename):
+    with open(filename, "rb") as f:
+        return f.read(4) == columnar_magic
+
+# The columns are mapped straight from the file, so nothing is read until
+# it's used. Rows that haven't finished yet are NaN.
+def read_columnar(filename):
+    header = np.fromfile(filename, dtype=columnar_header, count=1)[0]
+    if header["version"] != 1 or header["byteOrder"] != 0x01020304:
+        raise ValueError("{}: unsupported columnar file".format(filename))
+    num_columns = int(header["numColumns"])
+    descs = np.fromfile(filename, dtype=columnar_column, count=num_columns,
+                        offset=columnar_header.itemsize)
+    with open(filename, "rb") as f:
+        f.seek(columnar_header.itemsize + num_columns * columnar_column.itemsize)
+        labels = f.read(int(header["labelsSize"])).decode("utf-8").split("\n")[:-1]
+
+    rows = int(header["numRows"])
+    offset = int(header["dataOffset"])
+    columns = {}
+    for name, type in descs:
+        dtype = np.dtype("=" + type.decode())
+        if rows:
+            column = np.memmap(filename, dtype=dtype, mode="r", offset=offset,
+                               shape=(rows,))
+        else:
+            column = np.empty(0, dtype=dtype)
+        columns[name.decode()] = column
+        offset = (offset + rows * dtype.itemsize + 7) // 8 * 8
+    return columns, labels
+
+# The (param name, label) of each axis of a columnar sweep
+def columnar_axes(labels):
+    return [tuple(label.split("\t", 1)) for label in labels]
+
+# The CSV form of a columnar file, with axis labels instead of indices
+def print_columnar_csv(filename, out):
+    columns, labels = read_columnar(filename)
+    axes = columnar_axes(labels)
+    writer = csv.writer(out)
+    writer.writerow(columns.keys())
+    for row in zip(*columns.values()):
+        fields = []
+        for name, v in zip(columns, row):
+            if name == "axis" and axes:
+                fields.append(axes[int(v)][1])
+            elif isinstance(v, np.floating):
+                # Empty for rows not written yet, or a single replica's error
+                fields.append(repr(float(v)) if not np.isnan(v) else "")
+            else:
+                fields.append(int(v))
+        writer.writerow(fields)
+
+# Sweeps get one plot per axis, since their x scales differ
+def plot_columnar(filename):
+    columns, labels = read_columnar(filename)
+    if "axis" in columns:
+        for i, (name, label) in enumerate(columnar_axes(labels)):
+            rows = columns["axis"] == i
+            plt.errorbar(columns["x"][rows], columns["dps"][rows],
+                         yerr=columns["stdError"][rows], label=label)
+            plt.xlabel(name)
+            plt.ylabel("dps")
+            plt.title(filename)
+            plt.legend()
+            plt.show()
+    else:
+        # Replicas
+        dps = np.asarray(columns["dps"])
+        plt.hist(dps[~np.isnan(dps)], bins="auto", density=True)
+        plt.xlabel("dps")
+        plt.ylabel("density")
+        plt.title(filename)
+        plt.show()
+
+def read_rows(filename):
+    with open(filename, "r", newline="") as f:
+        return list(csv.reader(f, delimiter=","))
+
+def plot_sweep(filename, rows):
+    x = list(map(int, rows[0][1:]))
+    for row in rows[1:]:
+        y = list(map(float, row[1:]))
+        assert len(y) == len(x)
+        plt.plot(x, y, label=row[0])
+
+    plt.ylabel("dps")
+    plt.title(filename)
+    plt.legend()
+    plt.show()
+
+# The simulated points with their standard errors over the fitted curve,
+# one plot per axis since their x scales differ
+def plot_adaptive_sweep(filename, rows):
+    axes = {}
+    for axis, x, dps, std_error, kind in rows[1:]:
+        series = axes.setdefault(axis, { "point": [], "fit": [] })
+        series[kind].append((float(x), float(dps), float(std_error)))
+
+    for axis, series in axes.items():
+        x, y, err = zip(*series["fit"])
+        plt.plot(x, y, label="fit")
+        x, y, err = zip(*series["point"])
+        plt.errorbar(x, y, yerr=err, fmt="o", label="points")
+        plt.xlabel(axis.split(":")[0])
+        plt.ylabel("dps")
+        plt.title(filename)
+        plt.legend()
+        plt.show()
+
+# Histogram files of several shards add up bucket by bucket
+def plot_histograms(files):
+    histograms = {}
+    for filename, rows in files:
+        for name, low, high, count in rows[1:]:
+            buckets = histograms.setdefault(name, {})
+            key = (float(low), float(high))
+            buckets[key] = buckets.get(key, 0.0) + float(count)
+
+    for name, buckets in histograms.items():
+        keys = sorted(buckets)
+        # The overflow bucket has no upper bound, draw it as wide as the
+        # bucket before it
+        lows = [low for low, high in keys]
+        widths = [high - low if high != float("inf") else low - lows[i - 1]
+                  for i, (low, high) in enumerate(keys)]
+        total = sum(buckets.values())
+        heights = [buckets[k] / total / w for k, w in zip(keys, widths)]
+        plt.bar(lows, heights, width=widths, align="edge")
+        plt.ylabel("density")
+        plt.title(name)
+        plt.show()
 
 def main():
     parser = argparse.ArgumentParser(description="plot script")
     parser.add_argument("-v", "--verbose", action="store_true")
+    parser.add_argument("--csv", action="store_true",
+                        help="Print columnar files as CSV instead of plotting them")
     parser.add_argument("files", nargs="+")
 
     args = parser.parse_args()
 
+    histogram_files = []
     for filename in args.files:
-        rows = []
-        with open(filename, "r", newline="") as f:
-            data = csv.reader(f, delimiter=",")
-            for row in data:
-                rows.append(row)
-
-        x = list(map(int, rows[0][1:]))
-        for row in rows[1:]:
-            y = list(map(float, row[1:]))
-            assert len(y) == len(x)
-            plt.plot(x, y, label=row[0])
+        if is_columnar(filename):
+            if args.csv:
+                print_columnar_csv(filename, sys.stdout)
+            else:
+                plot_columnar(filename)
+            continue
+        rows = read_rows(filename)
+        if rows and rows[0] == histogram_header:
+            histogram_files.append((filename, rows))
+        elif rows and rows[0] == adaptive_sweep_header:
+            plot_adaptive_sweep(filename, rows)
+        else:
+            plot_sweep(filename, rows)
 
-        plt.ylabel("dps")
-        plt.title(filename)
-        plt.legend()
-        plt.show()
+    if histogram_files:
+        plot_histograms(histogram_files)
 
 main()